@@ -65,39 +65,37 @@ int assembleLine(const std::string &line, uint8_t *output, int pc) {
 			a.mode = NONE;
 		}
 
-		for(const auto &ins : Machine<>::getInstructions()) {
-			if(ins.name == matches[1]) {
-				for(auto &op : ins.opcodes) {
-					if(op.mode == ABSY && a.mode == ZPY) {
-						a.mode = ABSY;
-					}
-
-					if(op.mode == ABSX && a.mode == ZPX) {
-						a.mode = ABSX;
-					}
-
-					if(op.mode == ABS && a.mode == ZP) {
-						// An opcode that requires Abs. We assume Zp versions are always
-						// defined before Abs versions.
-						a.mode = ABS;
-
-					} else
-					if(op.mode == REL && (a.mode == ABS || a.mode == ZP)) {
-						printf("ABS %04x at PC %04x = REL %d", a.val, pc, a.val - pc - 2);
-						a.val = (int)a.val - pc - 2;
-						a.mode = REL;
-					}
-					if(op.mode == a.mode) {
-						//printf("Matched %02x\n", op.code);
-						auto saved = output;
-						*output++ = op.code;
-						if(opSize(a.mode) > 1)
-							*output++ = a.val & 0xff;
-						if(opSize(a.mode) > 2)
-							*output++ = a.val >> 8;
-						return output - saved;
-					};
+		for(const auto &op : Machine<>::instructionTable<>) {
+			if(op.name == matches[1]) {
+				if(op.mode == ABSY && a.mode == ZPY) {
+					a.mode = ABSY;
 				}
+
+				if(op.mode == ABSX && a.mode == ZPX) {
+					a.mode = ABSX;
+				}
+
+				if(op.mode == ABS && a.mode == ZP) {
+					// An opcode that requires Abs. We assume Zp versions are always
+					// defined before Abs versions.
+					a.mode = ABS;
+
+				} else
+				if(op.mode == REL && (a.mode == ABS || a.mode == ZP)) {
+					printf("ABS %04x at PC %04x = REL %d", a.val, pc, a.val - pc - 2);
+					a.val = (int)a.val - pc - 2;
+					a.mode = REL;
+				}
+				if(op.mode == a.mode) {
+					//printf("Matched %02x\n", op.code);
+					auto saved = output;
+					*output++ = op.code;
+					if(opSize(a.mode) > 1)
+						*output++ = a.val & 0xff;
+					if(opSize(a.mode) > 2)
+						*output++ = a.val >> 8;
+					return output - saved;
+				};
 			}
 		}
 	}
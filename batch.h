@@ -0,0 +1,915 @@
+#pragma once
+
+#include "emulator.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+namespace sixfive {
+
+// Runs N instances (lanes) of the same 6502 program in lockstep, for
+// instance to test a routine exhaustively with different inputs.
+//
+// Registers are stored as one array per register, and RAM is interleaved
+// so that the same adress in all lanes is contiguous. Every opcode function
+// loops over all lanes and masks out those that are not running it, which
+// lets the compiler vectorize them.
+//
+// Each step runs the opcode at the lowest PC, for all lanes at that PC.
+// Lanes that branch elsewhere wait (or run ahead on their own) and join
+// the others again when their PCs agree. A lane alone at its PC runs by
+// itself, without touching the other lanes.
+//
+// Each lane has 64K of plain RAM; there are no banks, callbacks or
+// `eachOp()`. Illegal opcodes stop the lane.
+template <typename POLICY = DefaultPolicy, int N = 32> struct MachineBatch
+{
+    using Lane = uint16_t;
+    using Lanes = std::array<Lane, N>;
+    using OpFunc = void (*)(MachineBatch&);
+
+    struct Opcode
+    {
+        OpFunc op;
+        uint8_t cycles;
+        AdressingMode mode;
+        // Can move lanes to different adresses, stop lanes, or change the
+        // decimal flag of some lanes. Branches handle this themselves.
+        bool diverges;
+        // Writes to memory, which may change the code of some lanes
+        bool writes;
+    };
+
+    // Opcodes run, and opcodes run summed over all lanes
+    struct Stats
+    {
+        uint64_t dispatches = 0;
+        uint64_t laneOps = 0;
+    };
+
+    MachineBatch() : ram(0x10000 * N)
+    {
+        a.fill(0);
+        x.fill(0);
+        y.fill(0);
+        sp.fill(0xff);
+        sr.fill(0x30);
+        result.fill(0);
+        pc.fill(0);
+        cycles.fill(0);
+        mask.fill(0);
+    }
+
+    // Access ram of one lane directly
+
+    uint8_t& Ram(int lane, uint16_t adr)
+    {
+        return reinterpret_cast<uint8_t&>(cell(adr, lane));
+    }
+    uint8_t Ram(int lane, uint16_t adr) const { return mem(adr, lane); }
+
+    // Write the same data to all lanes
+    void writeRam(uint16_t org, const uint8_t* data, int size)
+    {
+        for (int i = 0; i < size; i++) {
+            auto* p = &ram[((org + i) & 0xffff) * N];
+            std::fill(p, p + N, Cell{data[i]});
+        }
+    }
+
+    void writeRam(int lane, uint16_t org, uint8_t v) { cell(org, lane) = Cell{v}; }
+
+    void setPC(uint16_t p) { pc.fill(p); }
+
+    uint8_t regA(int lane) const { return a[lane]; }
+    uint8_t regX(int lane) const { return x[lane]; }
+    uint8_t regY(int lane) const { return y[lane]; }
+    uint8_t regSP(int lane) const { return sp[lane]; }
+    uint16_t regPC(int lane) const { return pc[lane]; }
+    uint8_t regSR(int lane) const { return get_SR(lane); }
+
+    auto regs(int lane)
+    {
+        return std::tie(a[lane], x[lane], y[lane], sr[lane], sp[lane],
+                        pc[lane]);
+    }
+
+    // Run all lanes until they have used `toCycles` cycles, or stopped
+    void run(uint32_t toCycles = 0x01000000)
+    {
+        cycles.fill(0);
+        grouped = false;
+        while (step(toCycles)) {}
+    }
+
+    const Stats& stats() const { return stat; }
+
+private:
+    enum REGNAME
+    {
+        A = 20,
+        X,
+        Y,
+        SP,
+        SR
+    };
+
+    enum STATUS_FLAGS
+    {
+        CARRY,
+        ZERO,
+        IRQ,
+        DECIMAL,
+        BRK,
+        xXx,
+        OVER,
+        SIGN
+    };
+
+    enum STATUS_BITS
+    {
+        C = 0x1,
+        Z = 0x2,
+        d_FLAG = 0x8,
+        V = 0x40,
+        S = 0x80,
+    };
+
+    static constexpr auto SZ = S | Z;
+    static constexpr auto SZC = S | Z | C;
+    static constexpr auto SZCV = S | Z | C | V;
+
+    static constexpr bool SET = true;
+    static constexpr bool CLEAR = false;
+
+    static constexpr unsigned NoLane = 0x10000;
+    static constexpr uint32_t Stopped =
+        std::numeric_limits<uint32_t>::max() - 32;
+
+    // Registers and flags as in `Machine`, one entry per lane
+    Lanes a;
+    Lanes x;
+    Lanes y;
+    Lanes sp;
+    Lanes sr;
+    Lanes result;
+    Lanes pc;
+    std::array<uint32_t, N> cycles;
+
+    // The group of lanes running the current opcode; 0xffff for lanes in
+    // the group, otherwise 0
+    Lanes mask;
+    // Lanes that may be in the group. Just one lane if it runs alone.
+    int lo = 0;
+    int hi = N;
+    // First lane of the group, and number of lanes in it
+    int lead = 0;
+    int count = 0;
+    // True while the group can keep running without looking at other lanes
+    bool grouped = false;
+    // Set when the last opcode moved the group or wrote to memory, so the
+    // lanes may no longer have the same code at `groupPc`
+    bool recheck = false;
+    // Set by a branch that sent the lanes of the group different ways
+    bool split = false;
+
+    // While grouped, the PC of all lanes in the group, and cycles not yet
+    // added to them, are only kept here
+    unsigned groupPc = 0;
+    uint32_t pending = 0;
+    bool deferred = false;
+    // Highest cycle count in the group, including `pending`
+    uint32_t maxCycles = 0;
+    // Lowest PC of all running lanes outside the group
+    unsigned waitPc = NoLane;
+
+    // Operand of the current opcode, and the adress after it
+    unsigned operand = 0;
+    unsigned next = 0;
+
+    // A byte of RAM. Not a char type, so that writes to it can not alias
+    // the registers, which would stop the compiler from vectorizing.
+    enum class Cell : uint8_t
+    {
+    };
+
+    // ram[adr * N + lane]
+    std::vector<Cell> ram;
+
+    static const std::array<std::array<Opcode, 256>, 2> jumpTables;
+
+    Stats stat;
+
+    // Run one opcode for the group of lanes at the lowest PC. Returns false
+    // when all lanes are done.
+    bool step(uint32_t toCycles)
+    {
+        if (grouped && recheck && !sameCode(groupPc)) {
+            flush();
+            grouped = false;
+        }
+        if (!grouped && !regroup(toCycles)) return false;
+
+        const auto& op = jumpTables[(sr[lead] >> DECIMAL) & 1][mem(groupPc, lead)];
+        unsigned size = opSize(op.mode);
+        operand = 0;
+        if (size > 1) operand = mem(groupPc + 1, lead);
+        if (size > 2) operand |= mem(groupPc + 2, lead) << 8;
+        next = (groupPc + size) & 0xffff;
+        groupPc = next;
+        pending += op.cycles;
+        maxCycles += op.cycles;
+        deferred = true;
+        recheck = op.diverges || op.writes;
+        stat.dispatches++;
+        stat.laneOps += count;
+
+        if (!op.diverges) {
+            op.op(*this);
+            if (split) {
+                split = grouped = false;
+                return true;
+            }
+            grouped = groupPc < waitPc && maxCycles < toCycles;
+            if (!grouped) flush();
+            return true;
+        }
+
+        // Write back PC before the opcode changes it for some lanes
+        flush();
+        op.op(*this);
+        // Stay grouped if all lanes took the same way
+        groupPc = pc[lead];
+        maxCycles++;
+        unsigned diff = 0;
+        each([&](int i) {
+            diff |= mask[i] & ((pc[i] ^ groupPc) | (cycles[i] >= toCycles) |
+                               ((sr[i] ^ sr[lead]) & d_FLAG));
+        });
+        grouped = diff == 0 && groupPc < waitPc && maxCycles < toCycles;
+        return true;
+    }
+
+    // Find the group of lanes at the lowest PC. Returns false if all lanes
+    // are done.
+    bool regroup(uint32_t toCycles)
+    {
+        // Lanes that are done count as being at NoLane
+        unsigned minPc = NoLane;
+        for (int i = 0; i < N; i++) {
+            unsigned p = pc[i] | (unsigned(cycles[i] >= toCycles) << 16);
+            minPc = p < minPc ? p : minPc;
+        }
+        if (minPc == NoLane) return false;
+        lead = 0;
+        while (pc[lead] != minPc || cycles[lead] >= toCycles)
+            lead++;
+        groupPc = minPc;
+
+        // Lanes at the same PC join if they have the same opcode bytes and
+        // decimal flag
+        unsigned dec = sr[lead] & d_FLAG;
+        Code code(*this, minPc);
+        for (int i = 0; i < N; i++) {
+            bool on = (cycles[i] < toCycles) & (pc[i] == minPc) &
+                      ((sr[i] & d_FLAG) == dec) & !code.differs(i);
+            mask[i] = on ? 0xffff : 0;
+        }
+
+        count = 0;
+        waitPc = NoLane;
+        maxCycles = 0;
+        for (int i = 0; i < N; i++) {
+            count += mask[i] & 1;
+            unsigned p = mask[i] || cycles[i] >= toCycles ? NoLane : pc[i];
+            waitPc = p < waitPc ? p : waitPc;
+            uint32_t c = mask[i] ? cycles[i] : 0;
+            maxCycles = c > maxCycles ? c : maxCycles;
+        }
+        lo = lead;
+        hi = count == 1 ? lead + 1 : N;
+        return true;
+    }
+
+    // The opcode bytes at an adress in the lead lane, to compare with
+    // other lanes
+    struct Code
+    {
+        Code(const MachineBatch& m, unsigned adr)
+            : r0(m.row(adr)), r1(m.row(adr + 1)), r2(m.row(adr + 2))
+        {
+            auto size = opSize(m.jumpTables[0][m.mem(adr, m.lead)].mode);
+            b0 = m.mem(adr, m.lead);
+            b1 = m.mem(adr + 1, m.lead);
+            b2 = m.mem(adr + 2, m.lead);
+            m1 = size > 1 ? 0xff : 0;
+            m2 = size > 2 ? 0xff : 0;
+        }
+        // Non zero if lane `i` has other opcode bytes
+        unsigned differs(int i) const
+        {
+            return (unsigned(r0[i]) ^ b0) | ((unsigned(r1[i]) ^ b1) & m1) |
+                   ((unsigned(r2[i]) ^ b2) & m2);
+        }
+        const Cell* r0;
+        const Cell* r1;
+        const Cell* r2;
+        unsigned b0, b1, b2;
+        unsigned m1, m2;
+    };
+
+    // Check that all lanes in the group still have the same opcode
+    bool sameCode(unsigned adr)
+    {
+        if (count == 1) return true;
+        Code code(*this, adr);
+        unsigned diff = 0;
+        each([&](int i) { diff |= mask[i] & code.differs(i); });
+        return diff == 0;
+    }
+
+    // Write back PC and cycles of the group
+    void flush()
+    {
+        if (!deferred) return;
+        each([&](int i) {
+            put(pc, i, groupPc);
+            cycles[i] += mask[i] ? pending : 0;
+        });
+        pending = 0;
+        deferred = false;
+    }
+
+    // A fixed trip count for groups lets the compiler vectorize the loop
+    // without any scalar prologue or epilogue
+    template <typename F> void each(F f)
+    {
+        if (hi - lo == 1) {
+            f(lo);
+            return;
+        }
+        for (int i = 0; i < N; i++)
+            f(i);
+    }
+
+    // Set a register for lane `i`, if it is running
+    void put(Lanes& r, int i, unsigned v)
+    {
+        r[i] = (v & mask[i]) | (r[i] & ~mask[i]);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    ///
+    /// MEMORY ACCESS
+    ///
+    /////////////////////////////////////////////////////////////////////////
+
+    Cell& cell(unsigned adr, int i) { return row(adr)[i]; }
+
+    unsigned mem(unsigned adr, int i) const
+    {
+        return static_cast<unsigned>(row(adr)[i]);
+    }
+
+    // Adress `adr` in all lanes. Keeping the lane index out of the unsigned
+    // adress calculation lets the compiler see that lanes are contiguous.
+    Cell* row(unsigned adr) { return &ram[(adr & 0xffff) * N]; }
+    const Cell* row(unsigned adr) const { return &ram[(adr & 0xffff) * N]; }
+
+    // Always read and write back, so that the loop over lanes can be
+    // vectorized. A lane only ever touches its own bytes.
+    void write(unsigned adr, int i, unsigned v)
+    {
+        auto& c = cell(adr, i);
+        c = Cell(((v & mask[i]) | (static_cast<unsigned>(c) & ~mask[i])) & 0xff);
+    }
+
+    unsigned read16(unsigned adr, int i) const
+    {
+        return mem(adr, i) | (mem(adr + 1, i) << 8);
+    }
+
+    template <int REG> Lanes& Reg()
+    {
+        if constexpr (REG == A) return a;
+        if constexpr (REG == X) return x;
+        if constexpr (REG == Y) return y;
+        if constexpr (REG == SP) return sp;
+    }
+
+    template <int MODE> unsigned ea(int i) const
+    {
+        if constexpr (MODE == ZP || MODE == ABS) return operand;
+        if constexpr (MODE == ZPX) return (operand + x[i]) & 0xff;
+        if constexpr (MODE == ZPY) return (operand + y[i]) & 0xff;
+        if constexpr (MODE == ABSX) return (operand + x[i]) & 0xffff;
+        if constexpr (MODE == ABSY) return (operand + y[i]) & 0xffff;
+        if constexpr (MODE == INDX) return read16((operand + x[i]) & 0xff, i);
+        if constexpr (MODE == INDY) return (read16(operand, i) + y[i]) & 0xffff;
+        if constexpr (MODE == IND) return read16(operand, i);
+    }
+
+    template <int MODE> unsigned load(int i) const
+    {
+        if constexpr (MODE == IMM)
+            return operand;
+        else
+            return mem(ea<MODE>(i), i);
+    }
+
+    void push(int i, unsigned v)
+    {
+        write(0x100 + sp[i], i, v);
+        put(sp, i, (sp[i] - 1) & 0xff);
+    }
+
+    unsigned stack(int i, unsigned offs) const
+    {
+        return mem(0x100 + ((sp[i] + offs) & 0xff), i);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    ///
+    /// THE STATUS REGISTER
+    ///
+    /////////////////////////////////////////////////////////////////////////
+
+    uint8_t get_SR(int i) const
+    {
+        return sr[i] | ((result[i] | (result[i] >> 2)) & 0x80) |
+               (!(result[i] & 0xff) << 1);
+    }
+
+    void set_SR(int i, uint8_t s)
+    {
+        put(result, i, ((s << 2) & 0x200) | !(s & Z));
+        put(sr, i, (s & ~SZ) | 0x30);
+    }
+
+    template <int BITS> void set(int i, unsigned res, unsigned arg = 0)
+    {
+        put(result, i, res);
+        if constexpr ((BITS & (C | V)) != 0) {
+            unsigned s = sr[i] & ~BITS;
+            if constexpr ((BITS & C) != 0) s |= (res >> 8) & 1;
+            if constexpr ((BITS & V) != 0)
+                s |= (~(a[i] ^ arg) & (a[i] ^ res) & 0x80) >> 1;
+            put(sr, i, s);
+        }
+    }
+
+    unsigned carry(int i) const { return sr[i] & 1; }
+
+    template <int FLAG, bool v> bool check(int i) const
+    {
+        if constexpr (FLAG == ZERO) return (result[i] & 0xff) ? !v : v;
+        if constexpr (FLAG == SIGN)
+            return (result[i] & 0x280) ? v : !v;
+        else
+            return (bool)(sr[i] & (1 << FLAG)) == v;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    ///
+    ///   OPCODES
+    ///
+    /////////////////////////////////////////////////////////////////////////
+
+    template <int FLAG, bool ON> static void Set(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            m.put(m.sr, i, (m.sr[i] & ~(1 << FLAG)) | (ON << FLAG));
+        });
+    }
+
+    template <int REG, int MODE> static void Store(MachineBatch& m)
+    {
+        m.each([&](int i) { m.write(m.ea<MODE>(i), i, m.Reg<REG>()[i]); });
+    }
+
+    template <int REG, int MODE> static void Load(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            auto v = m.load<MODE>(i);
+            m.put(m.Reg<REG>(), i, v);
+            m.set<SZ>(i, v);
+        });
+    }
+
+    template <int FLAG, bool ON> static void Branch(MachineBatch& m)
+    {
+        auto target = (m.next + static_cast<int8_t>(m.operand)) & 0xffff;
+        int taken = 0;
+        m.each([&](int i) { taken += m.check<FLAG, ON>(i) & m.mask[i] & 1; });
+        if (taken == 0) return;
+        if (taken == m.count) {
+            m.groupPc = target;
+            m.pending++;
+            m.maxCycles++;
+            m.recheck = true;
+            return;
+        }
+        // The group splits up
+        m.flush();
+        m.each([&](int i) {
+            bool taken = m.check<FLAG, ON>(i);
+            m.put(m.pc, i, taken ? target : m.next);
+            m.cycles[i] += taken && m.mask[i];
+        });
+        m.split = true;
+    }
+
+    template <int MODE, int INC> static void Inc(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            if constexpr (MODE >= A) {
+                auto v = (m.Reg<MODE>()[i] + INC) & 0xff;
+                m.put(m.Reg<MODE>(), i, v);
+                m.set<SZ>(i, v);
+            } else {
+                auto adr = m.ea<MODE>(i);
+                auto v = (m.mem(adr, i) + INC) & 0xff;
+                m.write(adr, i, v);
+                m.set<SZ>(i, v);
+            }
+        });
+    }
+
+    // === COMPARE, ADD & SUBTRACT
+
+    template <int MODE> static void Bit(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            unsigned z = m.load<MODE>(i);
+            m.put(m.result, i, (z & m.a[i]) | ((z & 0x80) << 2));
+            m.put(m.sr, i, (m.sr[i] & ~V) | (z & V));
+        });
+    }
+
+    template <int REG, int MODE> static void Cmp(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            unsigned z = (~m.load<MODE>(i)) & 0xff;
+            m.set<SZC>(i, m.Reg<REG>()[i] + z + 1);
+        });
+    }
+
+    template <int MODE, bool DEC = false> static void Sbc(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            unsigned a = m.a[i];
+            if constexpr (DEC) {
+                unsigned z = m.load<MODE>(i);
+                auto al = (a & 0xf) - (z & 0xf) + (m.carry(i) - 1);
+                auto ah = (a >> 4) - (z >> 4);
+                if (al & 0x10) {
+                    al = (al - 6) & 0xf;
+                    ah--;
+                }
+                if (ah & 0x10) ah = (ah - 6) & 0xf;
+                unsigned rc = a - z + (m.carry(i) - 1);
+                m.set<SZCV>(i, (rc ^ 0x100) & 0x3ff, z);
+                m.put(m.a, i, (al | (ah << 4)) & 0xff);
+            } else {
+                unsigned z = (~m.load<MODE>(i)) & 0xff;
+                unsigned rc = a + z + m.carry(i);
+                m.set<SZCV>(i, rc, z);
+                m.put(m.a, i, rc & 0xff);
+            }
+        });
+    }
+
+    template <int MODE, bool DEC = false> static void Adc(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            unsigned a = m.a[i];
+            unsigned z = m.load<MODE>(i);
+            unsigned rc = a + z + m.carry(i);
+            if constexpr (DEC) {
+                if (((a & 0xf) + (z & 0xf) + m.carry(i)) >= 10) rc += 6;
+                if ((rc & 0xff0) > 0x90) rc += 0x60;
+            }
+            m.set<SZCV>(i, rc, z);
+            m.put(m.a, i, rc & 0xff);
+        });
+    }
+
+    template <int MODE> static void And(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            auto v = m.a[i] & m.load<MODE>(i);
+            m.put(m.a, i, v);
+            m.set<SZ>(i, v);
+        });
+    }
+
+    template <int MODE> static void Ora(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            auto v = m.a[i] | m.load<MODE>(i);
+            m.put(m.a, i, v);
+            m.set<SZ>(i, v);
+        });
+    }
+
+    template <int MODE> static void Eor(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            auto v = m.a[i] ^ m.load<MODE>(i);
+            m.put(m.a, i, v);
+            m.set<SZ>(i, v);
+        });
+    }
+
+    // === SHIFTS & ROTATES
+
+    // Shift the accumulator or memory, `OP` returns the result with the
+    // new carry in bit 8
+    template <int MODE, typename OP> void shift(OP op)
+    {
+        each([&](int i) {
+            if constexpr (MODE == A) {
+                unsigned rc = op(a[i], carry(i));
+                set<SZC>(i, rc);
+                put(a, i, rc & 0xff);
+            } else {
+                auto adr = ea<MODE>(i);
+                unsigned rc = op(mem(adr, i), carry(i));
+                write(adr, i, rc & 0xff);
+                set<SZC>(i, rc);
+            }
+        });
+    }
+
+    template <int MODE> static void Asl(MachineBatch& m)
+    {
+        m.shift<MODE>([](unsigned v, unsigned) { return v << 1; });
+    }
+
+    template <int MODE> static void Rol(MachineBatch& m)
+    {
+        m.shift<MODE>([](unsigned v, unsigned c) { return (v << 1) | c; });
+    }
+
+    template <int MODE> static void Lsr(MachineBatch& m)
+    {
+        m.shift<MODE>(
+            [](unsigned v, unsigned) { return (v >> 1) | ((v & 1) << 8); });
+    }
+
+    template <int MODE> static void Ror(MachineBatch& m)
+    {
+        m.shift<MODE>([](unsigned v, unsigned c) {
+            return (v >> 1) | (c << 7) | ((v & 1) << 8);
+        });
+    }
+
+    template <int FROM, int TO> static void Transfer(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            auto v = m.Reg<FROM>()[i];
+            m.put(m.Reg<TO>(), i, v);
+            if constexpr (TO != SP) m.set<SZ>(i, v);
+        });
+    }
+
+    // === STACK & FLOW CONTROL
+
+    static void Nop(MachineBatch&) {}
+
+    // Illegal opcode
+    static void Stop(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            if (m.mask[i]) m.cycles[i] = Stopped;
+        });
+    }
+
+    template <int REG> static void Push(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            if constexpr (REG == SR)
+                m.push(i, m.get_SR(i));
+            else
+                m.push(i, m.Reg<REG>()[i]);
+        });
+    }
+
+    template <int REG> static void Pull(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            auto v = m.stack(i, 1);
+            m.put(m.sp, i, (m.sp[i] + 1) & 0xff);
+            if constexpr (REG == SR)
+                m.set_SR(i, v);
+            else
+                m.put(m.Reg<REG>(), i, v);
+        });
+    }
+
+    template <int MODE> static void Jmp(MachineBatch& m)
+    {
+        if constexpr (MODE == ABS)
+            m.each([&](int i) { m.put(m.pc, i, m.operand); });
+        else
+            m.each([&](int i) { m.put(m.pc, i, m.ea<MODE>(i)); });
+    }
+
+    static void Jsr(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            m.push(i, (m.next - 1) >> 8);
+            m.push(i, (m.next - 1) & 0xff);
+            m.put(m.pc, i, m.operand);
+        });
+    }
+
+    static void Rts(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            if constexpr (POLICY::ExitOnStackWrap) {
+                if (m.sp[i] == 0xff) {
+                    if (m.mask[i]) m.cycles[i] = Stopped;
+                    return;
+                }
+            }
+            m.put(m.pc, i, (m.stack(i, 1) | (m.stack(i, 2) << 8)) + 1);
+            m.put(m.sp, i, (m.sp[i] + 2) & 0xff);
+        });
+    }
+
+    static void Rti(MachineBatch& m)
+    {
+        m.each([&](int i) {
+            m.set_SR(i, m.stack(i, 1));
+            m.put(m.pc, i, m.stack(i, 2) | (m.stack(i, 3) << 8));
+            m.put(m.sp, i, (m.sp[i] + 3) & 0xff);
+        });
+    }
+
+    static void Brk(MachineBatch& m)
+    {
+        auto ret = m.next + 1;
+        m.each([&](int i) {
+            m.push(i, ret >> 8);
+            m.push(i, ret & 0xff);
+            m.push(i, m.get_SR(i));
+            m.put(m.pc, i, m.read16(0xfffe, i));
+        });
+    }
+
+    template <bool USE_BCD>
+    static constexpr std::pair<uint8_t, OpFunc> opcodeTable[] = {
+        { 0xea, &Nop },
+
+        { 0xa9, &Load<A, IMM> }, { 0xa5, &Load<A, ZP> },
+        { 0xb5, &Load<A, ZPX> }, { 0xad, &Load<A, ABS> },
+        { 0xbd, &Load<A, ABSX> }, { 0xb9, &Load<A, ABSY> },
+        { 0xa1, &Load<A, INDX> }, { 0xb1, &Load<A, INDY> },
+
+        { 0xa2, &Load<X, IMM> }, { 0xa6, &Load<X, ZP> },
+        { 0xb6, &Load<X, ZPY> }, { 0xae, &Load<X, ABS> },
+        { 0xbe, &Load<X, ABSY> },
+
+        { 0xa0, &Load<Y, IMM> }, { 0xa4, &Load<Y, ZP> },
+        { 0xb4, &Load<Y, ZPX> }, { 0xac, &Load<Y, ABS> },
+        { 0xbc, &Load<Y, ABSX> },
+
+        { 0x85, &Store<A, ZP> }, { 0x95, &Store<A, ZPX> },
+        { 0x8d, &Store<A, ABS> }, { 0x9d, &Store<A, ABSX> },
+        { 0x99, &Store<A, ABSY> }, { 0x81, &Store<A, INDX> },
+        { 0x91, &Store<A, INDY> },
+
+        { 0x86, &Store<X, ZP> }, { 0x96, &Store<X, ZPY> },
+        { 0x8e, &Store<X, ABS> },
+
+        { 0x84, &Store<Y, ZP> }, { 0x94, &Store<Y, ZPX> },
+        { 0x8c, &Store<Y, ABS> },
+
+        { 0xc6, &Inc<ZP, -1> }, { 0xd6, &Inc<ZPX, -1> },
+        { 0xce, &Inc<ABS, -1> }, { 0xde, &Inc<ABSX, -1> },
+
+        { 0xe6, &Inc<ZP, 1> }, { 0xf6, &Inc<ZPX, 1> },
+        { 0xee, &Inc<ABS, 1> }, { 0xfe, &Inc<ABSX, 1> },
+
+        { 0xaa, &Transfer<A, X> }, { 0x8a, &Transfer<X, A> },
+        { 0xa8, &Transfer<A, Y> }, { 0x98, &Transfer<Y, A> },
+        { 0x9a, &Transfer<X, SP> }, { 0xba, &Transfer<SP, X> },
+
+        { 0xca, &Inc<X, -1> }, { 0xe8, &Inc<X, 1> },
+        { 0x88, &Inc<Y, -1> }, { 0xc8, &Inc<Y, 1> },
+
+        { 0x48, &Push<A> }, { 0x68, &Pull<A> },
+        { 0x08, &Push<SR> }, { 0x28, &Pull<SR> },
+
+        { 0x90, &Branch<CARRY, CLEAR> }, { 0xb0, &Branch<CARRY, SET> },
+        { 0xd0, &Branch<ZERO, CLEAR> }, { 0xf0, &Branch<ZERO, SET> },
+        { 0x10, &Branch<SIGN, CLEAR> }, { 0x30, &Branch<SIGN, SET> },
+        { 0x50, &Branch<OVER, CLEAR> }, { 0x70, &Branch<OVER, SET> },
+
+        { 0x69, &Adc<IMM, USE_BCD> }, { 0x65, &Adc<ZP, USE_BCD> },
+        { 0x75, &Adc<ZPX, USE_BCD> }, { 0x6d, &Adc<ABS, USE_BCD> },
+        { 0x7d, &Adc<ABSX, USE_BCD> }, { 0x79, &Adc<ABSY, USE_BCD> },
+        { 0x61, &Adc<INDX, USE_BCD> }, { 0x71, &Adc<INDY, USE_BCD> },
+
+        { 0xe9, &Sbc<IMM, USE_BCD> }, { 0xe5, &Sbc<ZP, USE_BCD> },
+        { 0xf5, &Sbc<ZPX, USE_BCD> }, { 0xed, &Sbc<ABS, USE_BCD> },
+        { 0xfd, &Sbc<ABSX, USE_BCD> }, { 0xf9, &Sbc<ABSY, USE_BCD> },
+        { 0xe1, &Sbc<INDX, USE_BCD> }, { 0xf1, &Sbc<INDY, USE_BCD> },
+
+        { 0xc9, &Cmp<A, IMM> }, { 0xc5, &Cmp<A, ZP> },
+        { 0xd5, &Cmp<A, ZPX> }, { 0xcd, &Cmp<A, ABS> },
+        { 0xdd, &Cmp<A, ABSX> }, { 0xd9, &Cmp<A, ABSY> },
+        { 0xc1, &Cmp<A, INDX> }, { 0xd1, &Cmp<A, INDY> },
+
+        { 0xe0, &Cmp<X, IMM> }, { 0xe4, &Cmp<X, ZP> },
+        { 0xec, &Cmp<X, ABS> },
+
+        { 0xc0, &Cmp<Y, IMM> }, { 0xc4, &Cmp<Y, ZP> },
+        { 0xcc, &Cmp<Y, ABS> },
+
+        { 0x29, &And<IMM> }, { 0x25, &And<ZP> },
+        { 0x35, &And<ZPX> }, { 0x2d, &And<ABS> },
+        { 0x3d, &And<ABSX> }, { 0x39, &And<ABSY> },
+        { 0x21, &And<INDX> }, { 0x31, &And<INDY> },
+
+        { 0x49, &Eor<IMM> }, { 0x45, &Eor<ZP> },
+        { 0x55, &Eor<ZPX> }, { 0x4d, &Eor<ABS> },
+        { 0x5d, &Eor<ABSX> }, { 0x59, &Eor<ABSY> },
+        { 0x41, &Eor<INDX> }, { 0x51, &Eor<INDY> },
+
+        { 0x09, &Ora<IMM> }, { 0x05, &Ora<ZP> },
+        { 0x15, &Ora<ZPX> }, { 0x0d, &Ora<ABS> },
+        { 0x1d, &Ora<ABSX> }, { 0x19, &Ora<ABSY> },
+        { 0x01, &Ora<INDX> }, { 0x11, &Ora<INDY> },
+
+        { 0x38, &Set<CARRY, true> }, { 0x18, &Set<CARRY, false> },
+        { 0x58, &Set<IRQ, false> }, { 0x78, &Set<IRQ, true> },
+        { 0xf8, &Set<DECIMAL, true> }, { 0xd8, &Set<DECIMAL, false> },
+        { 0xb8, &Set<OVER, false> },
+
+        { 0x4a, &Lsr<A> }, { 0x46, &Lsr<ZP> }, { 0x56, &Lsr<ZPX> },
+        { 0x4e, &Lsr<ABS> }, { 0x5e, &Lsr<ABSX> },
+
+        { 0x0a, &Asl<A> }, { 0x06, &Asl<ZP> }, { 0x16, &Asl<ZPX> },
+        { 0x0e, &Asl<ABS> }, { 0x1e, &Asl<ABSX> },
+
+        { 0x6a, &Ror<A> }, { 0x66, &Ror<ZP> }, { 0x76, &Ror<ZPX> },
+        { 0x6e, &Ror<ABS> }, { 0x7e, &Ror<ABSX> },
+
+        { 0x2a, &Rol<A> }, { 0x26, &Rol<ZP> }, { 0x36, &Rol<ZPX> },
+        { 0x2e, &Rol<ABS> }, { 0x3e, &Rol<ABSX> },
+
+        { 0x24, &Bit<ZP> }, { 0x2c, &Bit<ABS> },
+
+        { 0x40, &Rti }, { 0x00, &Brk }, { 0x60, &Rts },
+        { 0x4c, &Jmp<ABS> }, { 0x6c, &Jmp<IND> }, { 0x20, &Jsr },
+    };
+
+    static constexpr bool sameName(const char* a, const char* b)
+    {
+        while (*a && *a == *b) {
+            a++;
+            b++;
+        }
+        return *a == *b;
+    }
+
+    // Take cycles and adressing modes from the normal machine
+    template <bool USE_BCD> static constexpr std::array<Opcode, 256> makeJumpTable()
+    {
+        std::array<Opcode, 256> t{};
+        for (unsigned code = 0; code < 256; code++) {
+            const auto& o = Machine<POLICY>::opcodeInfo[code];
+            if (!o.name || o.cycles == 0) {
+                t[code] = {&Stop, 2, NONE, true, false};
+                continue;
+            }
+            bool diverges = false;
+            for (unsigned c : {0x4c, 0x6c, 0x20, 0x60, 0x40, 0x00, 0x28})
+                diverges |= code == c;
+            bool writes = o.name[0] == 's' && o.name[1] == 't';
+            for (auto n : {"inc", "dec", "asl", "lsr", "rol", "ror"})
+                writes |= sameName(o.name, n) && o.mode != NONE && o.mode != ACC;
+            for (auto n : {"pha", "php", "jsr", "brk"})
+                writes |= sameName(o.name, n);
+            t[code] = {&Stop, o.cycles, o.mode, diverges, writes};
+        }
+        for (const auto& d : opcodeTable<USE_BCD>)
+            t[d.first].op = d.second;
+        return t;
+    }
+};
+
+// Shared by all batches, and indexed by the decimal flag
+template <typename POLICY, int N>
+constexpr std::array<std::array<typename MachineBatch<POLICY, N>::Opcode, 256>, 2>
+    MachineBatch<POLICY, N>::jumpTables = {
+        MachineBatch::makeJumpTable<false>(),
+        MachineBatch::makeJumpTable<true>()};
+
+} // namespace sixfive
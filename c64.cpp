@@ -1,52 +1,105 @@
 #include "emulator.h"
+#include "reu.h"
 
-#include <coreutils/file.h>
 #include <coreutils/log.h>
 
 struct C64Policy : sixfive::DefaultPolicy
 {
-    static bool eachOp(sixfive::Machine<C64Policy>& m)
-    {
-        //LOGD("PC: %04x", m.regPC());
-        return false;
-    }
+    // The VIC raster line, moved on by an event at the end of each line
+    unsigned rasterLine = 0;
+    uint64_t nextLine = 0;
+
+    // Waiting for the raster is skipped until the next line
+    static constexpr bool SkipIdleLoops = true;
+
+    // A 512K RAM expansion at $df00
+    sixfive::Reu reu;
+
+    // Only the zero page and IO need callbacks
+    static constexpr int Read_AccessMode = sixfive::HYBRID;
+    static constexpr int Write_AccessMode = sixfive::HYBRID;
 };
 
-int main()
+using C64 = sixfive::Machine<C64Policy>;
+
+// PAL timing
+static constexpr unsigned CyclesPerLine = 63;
+static constexpr unsigned Lines = 312;
+
+static void newRasterLine(C64& m)
 {
-    using C64 = sixfive::Machine<C64Policy>;
+    auto& p = m.policy();
+    p.rasterLine = (p.rasterLine + 1) % Lines;
+    p.nextLine += CyclesPerLine;
+    m.schedule(p.nextLine, &newRasterLine);
+}
 
-    C64 machine;
+static uint8_t logRead(C64& m, uint16_t adr)
+{
+    LOGI("IO Read from %04x", adr);
+    return 0;
+}
 
-    logging::setLevel(logging::DEBUG);
+static void logWrite(C64& m, uint16_t adr, uint8_t v)
+{
+    LOGI("%04x : IO Write %02x to %04x", m.regPC(), v, adr);
+}
 
-    auto kernal = utils::File{"c64/kernal"}.readAll();
-    auto basic = utils::File{"c64/basic"}.readAll();
-    auto cargen = utils::File{"c64/chargen"}.readAll();
+int main()
+{
+    C64 machine;
 
-    machine.mapRom(0xe0, &kernal[0], 8192);
-    machine.mapRom(0xa0, &basic[0], 8192);
+    logging::setLevel(logging::DEBUG);
 
-    machine.mapReadCallback(0xD0, 4096,
-                            [](const C64& m, uint16_t adr) -> uint8_t {
-                                LOGI("IO Read from %04x", adr);
-                                return 0;
-                            });
-    machine.mapWriteCallback(0xD0, 4096, [](C64& m, uint16_t adr, uint8_t v) {
-        LOGI("%04x : IO Write %02x to %04x", m.regPC(), v, adr);
-    });
+    // Mapped from the files, and shared with other processes
+    sixfive::RomFile kernal{"c64/kernal"};
+    sixfive::RomFile basic{"c64/basic"};
+    sixfive::RomFile chargen{"c64/chargen"};
 
+    // Configuration 0 is all RAM. The processor port at $01 selects one of
+    // 8 configurations, that are set up here once.
     machine.mapWriteCallback(0x00, 256, [](C64& m, uint16_t adr, uint8_t v) {
-        if (adr == 0x0001) {
-            LOGD("Write %02x to $01", v);
-            // Do bank switch
-        }
         m.Ram(adr) = v;
+        if (adr == 0x0001) m.setConfig(v & 7);
     });
+    for (unsigned n = 1; n < 8; n++) {
+        machine.setConfig(0);
+        machine.setConfig(machine.addConfig());
+        bool loram = n & 1;
+        bool hiram = n & 2;
+        bool charen = n & 4;
+        if (loram && hiram) machine.mapRom(0xa0, basic);
+        if (hiram) machine.mapRom(0xe0, kernal);
+        if (!loram && !hiram) continue;
+        if (!charen) {
+            machine.mapRom(0xd0, chargen);
+            continue;
+        }
+        // VIC registers repeat every 64 bytes. Only the raster is emulated.
+        machine.mapIO(
+            0xd000, 0x400,
+            [](C64& m, uint16_t adr) -> uint8_t {
+                auto line = m.policy().rasterLine;
+                if (adr == 0xd012) return line & 0xff;
+                if (adr == 0xd011) return (line >> 1) & 0x80;
+                return logRead(m, adr);
+            },
+            &logWrite, 64, true);
+        // SID, and the two CIAs. Color RAM at $d800 is left as RAM.
+        machine.mapIO(0xd400, 0x400, &logRead, &logWrite, 32);
+        machine.mapIO(0xdc00, 0x100, &logRead, &logWrite, 16);
+        machine.mapIO(0xdd00, 0x100, &logRead, &logWrite, 16);
+        sixfive::Reu::map(machine, 0xdf00);
+    }
+    machine.writeRam(0x0001, 0x37);
+    machine.setConfig(7);
 
     uint16_t start = machine.readMem(0xfffc) | (machine.readMem(0xfffd) << 8);
     machine.setPC(start);
+    machine.policy().nextLine = CyclesPerLine;
+    machine.schedule(CyclesPerLine, &newRasterLine);
     machine.run(1000000);
+    LOGI("Skipped %d idle cycles", (int)machine.runStats().idleCycles);
     for(int i=0x1000; i<0x1100; i++)
         printf("%02x ", machine.Ram(i));
 }
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+
+namespace sixfive {
+
+// Devices come in two kinds. Those in this file are fixed at compile time
+// by `POLICY::Devices`. The others (`Reu`, `HostFile` and `Pipe`) are
+// mapped at run time with their static `map()`, which calls
+// `Machine::mapIO()`. Either way, device state belongs in the policy, where
+// the device finds it by name: `reu`, `hostFile` or `pipe`.
+
+// Gives devices access to the RAM of a `Machine`
+struct DeviceAccess
+{
+    template <typename MACHINE> static auto& ram(MACHINE& m) { return m.ram; }
+};
+
+// A device at adresses `START` to `END`. Devices derive from this and add
+// static `read(m, adr)` and `write(m, adr, v)` functions, that are called
+// for all adresses in the range.
+template <unsigned START, unsigned END> struct Device
+{
+    static constexpr unsigned Start = START;
+    static constexpr unsigned End = END;
+
+    // Reads only change when an event runs (see `POLICY::SkipIdleLoops`)
+    static constexpr bool Steady = false;
+
+    static constexpr bool contains(unsigned adr)
+    {
+        return adr >= START && adr <= END;
+    }
+};
+
+template <unsigned START, unsigned END> struct Ram : Device<START, END>
+{
+    static constexpr bool Steady = true;
+
+    template <typename MACHINE>
+    static unsigned read(MACHINE& m, unsigned adr)
+    {
+        return DeviceAccess::ram(m)[adr];
+    }
+
+    template <typename MACHINE>
+    static void write(MACHINE& m, unsigned adr, unsigned v)
+    {
+        DeviceAccess::ram(m)[adr] = v;
+    }
+};
+
+// The memory map of a policy with `Read_AccessMode` and `Write_AccessMode`
+// set to DEVICES, for example
+//
+//   using Devices = sixfive::Devices<Ram<0x0000, 0xcfff>, Vic<0xd000>>;
+//
+// Devices are checked in order, and adresses that no device covers go to
+// RAM. Everything is known at compile time, so an access compiles to a few
+// compares and the inlined device functions.
+template <typename... DEVICES> struct Devices;
+
+template <> struct Devices<>
+{
+    template <typename MACHINE>
+    static unsigned read(MACHINE& m, unsigned adr)
+    {
+        return DeviceAccess::ram(m)[adr];
+    }
+
+    template <typename MACHINE>
+    static void write(MACHINE& m, unsigned adr, unsigned v)
+    {
+        DeviceAccess::ram(m)[adr] = v;
+    }
+
+    static constexpr bool steady(unsigned) { return true; }
+};
+
+template <typename DEVICE, typename... REST> struct Devices<DEVICE, REST...>
+{
+    template <typename MACHINE>
+    static unsigned read(MACHINE& m, unsigned adr)
+    {
+        if (DEVICE::contains(adr)) return DEVICE::read(m, adr);
+        return Devices<REST...>::read(m, adr);
+    }
+
+    template <typename MACHINE>
+    static void write(MACHINE& m, unsigned adr, unsigned v)
+    {
+        if (DEVICE::contains(adr))
+            DEVICE::write(m, adr, v);
+        else
+            Devices<REST...>::write(m, adr, v);
+    }
+
+    // True if only steady devices cover some part of `page`
+    static constexpr bool steady(unsigned page)
+    {
+        bool covers = DEVICE::Start < (page + 1) * 256 &&
+                      DEVICE::End >= page * 256;
+        return (!covers || DEVICE::Steady) && Devices<REST...>::steady(page);
+    }
+};
+
+} // namespace sixfive
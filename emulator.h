@@ -1,9 +1,18 @@
 #pragma once
 
+#include "memory.h"
+
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <cstring>
 #include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 namespace sixfive {
@@ -33,13 +42,29 @@ static constexpr inline int opSize(AdressingMode am)
 }
 
 template <typename POLICY> struct Machine;
+template <typename MACHINE> struct Jit;
+struct DeviceAccess;
 
 enum EmulatedMemoryAccess
 {
     DIRECT,  // Access `ram` array directly; Means no bank switching, ROM areas
              // or IO areas
     BANKED,  // Access memory through `wbank` and `rbank`; Means no IO areas
-    CALLBACK // Access memory via function pointer per bank
+    CALLBACK, // Access memory via function pointer per bank
+    HYBRID,   // Like BANKED, except for banks with a callback mapped
+    DEVICES   // Access memory through the `POLICY::Devices` map, which is
+              // fixed at compile time. Needs `devices.h`.
+};
+
+enum OpcodeDispatch
+{
+    TABLE,   // `run` fetches each opcode and calls it through the jump table
+    THREADED, // Each opcode function fetches and tail calls the next opcode
+              // function itself; No shared dispatch loop
+    PREDECODED, // Opcodes are decoded once per adress into a cache, and `run`
+                // dispatches from the cache. Writes invalidate cached opcodes.
+    JIT // Hot blocks are compiled to x86-64 code. Needs `jit.h`, and an
+        // x86-64 host.
 };
 
 // The Policy defines the compile & runtime time settings for the emulator
@@ -59,132 +84,464 @@ struct DefaultPolicy
 
     static constexpr int MemSize = 65536;
 
-    // This function is run after each opcode. Return true to stop emulation.
+    static constexpr int Dispatch = TABLE;
+
+    // Count opcodes and opcode sequences run by a TABLE dispatched machine
+    static constexpr bool ProfileOpcodes = false;
+
+    // Run common opcode sequences from one dispatch; TABLE or THREADED only
+    static constexpr bool Superinstructions = false;
+
+    // Keep the operands of the last arithmetic op instead of computing
+    // the C and V flags, and only derive them when they are read
+    static constexpr bool LazyFlags = false;
+
+    // Detect loops that only poll memory that can not change until the
+    // next event, like `JMP *` or `LDA $D012; CMP #n; BNE`, and skip
+    // their cycles forward to the next event or the end of `run`
+    static constexpr bool SkipIdleLoops = false;
+
+    // Track the pages written to, so `restore()` only copies those back.
+    // Needed for `snapshot()` and `restore()`.
+    static constexpr bool Snapshots = false;
+
+    // This function is run before each opcode, for tracing and debugging.
+    // Return true to stop emulation. Timed work should use
+    // `Machine::schedule()` instead, which costs nothing between events.
     static constexpr bool eachOp(DefaultPolicy&) { return false; }
 };
 
+// Opcode statistics collected when `POLICY::ProfileOpcodes` is set
+struct OpcodeProfile
+{
+    uint64_t dispatches = 0;
+    // Opcodes run by superinstructions, without a dispatch of their own
+    uint64_t fused = 0;
+
+    std::vector<uint64_t> pairs = std::vector<uint64_t>(0x10000);
+    std::unordered_map<uint32_t, uint64_t> triples;
+
+    // Last two dispatched opcodes, with bit 8 set when valid
+    unsigned last[2] = {0, 0};
+
+    void add(unsigned code)
+    {
+        dispatches++;
+        auto prev = last[0] & 0xff;
+        if (last[0]) pairs[(prev << 8) | code]++;
+        if (last[1]) triples[((last[1] & 0xff) << 16) | (prev << 8) | code]++;
+        last[1] = last[0];
+        last[0] = code | 0x100;
+    }
+
+    struct Sequence
+    {
+        std::vector<uint8_t> codes;
+        uint64_t count;
+    };
+
+    // Most common sequences, ordered by the number of dispatches that
+    // would be saved by making them superinstructions
+    std::vector<Sequence> top(size_t n) const
+    {
+        std::vector<Sequence> seqs;
+        for (unsigned i = 0; i < pairs.size(); i++)
+            if (pairs[i]) seqs.push_back({{uint8_t(i >> 8), uint8_t(i)}, pairs[i]});
+        for (const auto& [k, count] : triples)
+            seqs.push_back(
+                {{uint8_t(k >> 16), uint8_t(k >> 8), uint8_t(k)}, count});
+        auto saved = [](const Sequence& s) {
+            return s.count * (s.codes.size() - 1);
+        };
+        std::sort(seqs.begin(), seqs.end(),
+                  [&](auto& a, auto& b) { return saved(a) > saved(b); });
+        if (seqs.size() > n) seqs.resize(n);
+        return seqs;
+    }
+};
+
 template <typename POLICY = DefaultPolicy> struct Machine
 {
+    using Policy = POLICY;
     using Adr = uint16_t;
     using Word = uint8_t;
 
     using OpFunc = void (*)(Machine&);
+    // Threaded opcode functions get the cycles of their opcode
+    using ThreadFunc = void (*)(Machine&, unsigned);
+
+    // An opcode function together with its threaded version
+    struct Handler
+    {
+        OpFunc op;
+        ThreadFunc thread;
+    };
 
     struct Opcode
     {
-        Opcode() = default;
-        Opcode(int code, int cycles, AdressingMode mode, OpFunc op)
-            : code(code), cycles(cycles), mode(mode), op(op)
+        constexpr Opcode() = default;
+        constexpr Opcode(int code, int cycles, AdressingMode mode, Handler h)
+            : op(h.op), thread(h.thread), cycles(cycles), code(code), mode(mode)
         {}
-        OpFunc op;
-        uint8_t cycles;
+        OpFunc op = nullptr;
+        ThreadFunc thread = nullptr;
+        uint8_t cycles = 0;
+        uint8_t code = 0;
+        AdressingMode mode = BAD;
+    };
+
+    // An entry in `instructionTable`
+    struct OpcodeDef
+    {
+        const char* name;
         uint8_t code;
+        uint8_t cycles;
         AdressingMode mode;
+        Handler handler;
     };
 
-    struct Instruction
+    // What is known about an opcode, without running it. `name` is null
+    // for illegal opcodes.
+    struct OpcodeInfo
     {
-        Instruction(const char* name, std::vector<Opcode> ov)
-            : name(name), opcodes(std::move(ov))
-        {}
-        const char* name;
-        std::vector<Opcode> opcodes;
+        const char* name = nullptr;
+        uint8_t cycles = 0;
+        AdressingMode mode = BAD;
+        uint8_t size = 0;
     };
 
+    // Tables indexed by opcode, generated at compile time and shared by
+    // all machines
+    static const std::array<Opcode, 256> jumpTable_normal;
+    static const std::array<Opcode, 256> jumpTable_bcd;
+    static const std::array<OpcodeInfo, 256> opcodeInfo;
+
     ~Machine() = default;
+    // RAM and the page map are on the heap, so moves only copy pointers
+    // and registers. A policy constructed with a `Machine&` still refers
+    // to the machine it was constructed with.
     Machine(Machine&& op) noexcept = default;
     Machine& operator=(Machine&& op) noexcept = default;
 
     Machine()
     {
         sp = 0xff;
-        ram.fill(0);
         stack = &ram[0x100];
         a = x = y = 0;
         sr = 0x30;
         result = 0;
+        cres = 0;
+        vres = 0;
+        stopCycles = 0;
+        dirtyPages.fill(0);
+        borrowed.fill(0);
         for (int i = 0; i < 256; i++) {
-            rbank[i] = wbank[i] = &ram[(i * 256) % POLICY::MemSize];
-            rcallbacks[i] = &read_bank;
-            wcallbacks[i] = &write_bank;
+            pages->rbank[i] = pages->wbank[i] =
+                &ram[(i * 256) % POLICY::MemSize];
+            setReadCallback(i, &read_bank);
+            setWriteCallback(i, &write_bank);
         }
-        for (const auto& i : getInstructions<false>()) {
-            for (const auto& o : i.opcodes)
-                jumpTable_normal[o.code] = o;
+        if constexpr (POLICY::ProfileOpcodes)
+            profile = std::make_unique<OpcodeProfile>();
+        jumpTable = &jumpTable_normal[0];
+        if constexpr (POLICY::Dispatch == PREDECODED) {
+            decoded.resize(POLICY::MemSize);
+            decodedPages.fill(0);
+            decodeGen = 1;
         }
-        for (const auto& i : getInstructions<true>()) {
-            for (const auto& o : i.opcodes)
-                jumpTable_bcd[o.code] = o;
+        if constexpr (POLICY::Dispatch == JIT) {
+            decodedPages.fill(0);
+            codeDirty = false;
+            jit = std::make_shared<Jit<Machine>>(*this);
         }
-        jumpTable = &jumpTable_normal[0];
     }
 
-    POLICY& policy()
-    {
-        static POLICY policy(*this);
-        return policy;
-    }
+    POLICY& policy() { return policyState; }
+    const POLICY& policy() const { return policyState; }
 
     // Access ram directly
 
-    const Word& Ram(const Adr& a) const { return ram[a]; }
-    Word& Ram(const Adr& a) { return ram[a]; }
+    const Word& Ram(const Adr& a) const { return pageData(hi(a))[lo(a)]; }
+    Word& Ram(const Adr& a)
+    {
+        unshare(hi(a));
+        return ram[a];
+    }
 
     const Word& Stack(const Word& a) const { return stack[a]; }
 
-    void writeRam(uint16_t org, const Word data) { ram[org] = data; }
+    void writeRam(uint16_t org, const Word data)
+    {
+        unshare(hi(org));
+        ram[org] = data;
+        touched(hi(org));
+        codeWritten(org);
+    }
+
+    // Ranges are copied a page at a time, and wrap around at $ffff
 
     void writeRam(uint16_t org, const uint8_t* data, int size)
     {
-        for (int i = 0; i < size; i++)
-            ram[org + i] = data[i];
+        eachPage(org, size, [&](unsigned adr, unsigned i, unsigned n) {
+            unshare(hi(adr));
+            std::memcpy(ownPage(hi(adr)) + lo(adr), data + i, n);
+            touched(hi(adr));
+        });
+        codeWritten(org, size);
+    }
+
+    void fillRam(uint16_t org, uint8_t v, int size)
+    {
+        eachPage(org, size, [&](unsigned adr, unsigned, unsigned n) {
+            unshare(hi(adr));
+            std::memset(ownPage(hi(adr)) + lo(adr), v, n);
+            touched(hi(adr));
+        });
+        codeWritten(org, size);
     }
 
     void readRam(uint16_t org, uint8_t* data, int size) const
     {
-        for (int i = 0; i < size; i++)
-            data[i] = ram[org + i];
+        eachPage(org, size, [&](unsigned adr, unsigned i, unsigned n) {
+            std::memcpy(data + i, pageData(hi(adr)) + lo(adr), n);
+        });
+    }
+
+    // Copy RAM from `from` to `to`. The ranges may overlap.
+    void moveRam(uint16_t to, uint16_t from, int size)
+    {
+        eachMove(to, from, size, [&](auto dst, auto src, auto n, bool) {
+            unshare(hi(dst));
+            std::memmove(ownPage(hi(dst)) + lo(dst),
+                         pageData(hi(src)) + lo(src), n);
+            touched(hi(dst));
+        });
+        codeWritten(to, size);
+    }
+
+    uint8_t readRam(uint16_t org) const { return Ram(org); }
+
+    // Access memory through bank mapping, like the CPU does. Pages with
+    // callbacks are accessed through them, one byte at a time.
+
+    uint8_t readMem(uint16_t org)
+    {
+        if (pages->rhooked[org >> 8])
+            return pages->rcallbacks[org >> 8](*this, org);
+        return pages->rbank[org >> 8][org & 0xff];
+    }
+
+    void readMem(uint16_t org, uint8_t* data, int size)
+    {
+        eachPage(org, size, [&](unsigned adr, unsigned i, unsigned n) {
+            auto p = hi(adr);
+            if (pages->rhooked[p]) {
+                for (unsigned j = 0; j < n; j++)
+                    data[i + j] = pages->rcallbacks[p](*this, adr + j);
+            } else
+                std::memcpy(data + i, pages->rbank[p] + lo(adr), n);
+        });
     }
 
-    uint8_t readRam(uint16_t org) const { return ram[org]; }
+    // Read memory like `readMem()`, but without calling read callbacks, for
+    // monitors and disassemblers. Pages with callbacks read from their
+    // bank, so IO shows the RAM under it.
+
+    uint8_t peekMem(uint16_t org) const
+    {
+        return pages->rbank[org >> 8][org & 0xff];
+    }
+
+    void peekMem(uint16_t org, uint8_t* data, int size) const
+    {
+        eachPage(org, size, [&](unsigned adr, unsigned i, unsigned n) {
+            std::memcpy(data + i, pages->rbank[hi(adr)] + lo(adr), n);
+        });
+    }
 
-    // Access memory through bank mapping
+    void writeMem(uint16_t org, const uint8_t* data, int size)
+    {
+        eachPage(org, size, [&](unsigned adr, unsigned i, unsigned n) {
+            auto p = hi(adr);
+            if (pages->wcallbacks[p] == &write_shared) unshare(p);
+            if (pages->whooked[p]) {
+                for (unsigned j = 0; j < n; j++)
+                    pages->wcallbacks[p](*this, adr + j, data[i + j]);
+            } else
+                std::memcpy(pages->wbank[p] + lo(adr), data + i, n);
+            touched(p);
+        });
+        codeWritten(org, size);
+    }
 
-    uint8_t readMem(uint16_t org) const { return rbank[org >> 8][org & 0xff]; }
+    void fillMem(uint16_t org, uint8_t v, int size)
+    {
+        eachPage(org, size, [&](unsigned adr, unsigned, unsigned n) {
+            auto p = hi(adr);
+            if (pages->wcallbacks[p] == &write_shared) unshare(p);
+            if (pages->whooked[p]) {
+                for (unsigned j = 0; j < n; j++)
+                    pages->wcallbacks[p](*this, adr + j, v);
+            } else
+                std::memset(pages->wbank[p] + lo(adr), v, n);
+            touched(p);
+        });
+        codeWritten(org, size);
+    }
 
-    void readMem(uint16_t org, uint8_t* data, int size) const
+    // Copy memory from `from` to `to`. The ranges may overlap.
+    void moveMem(uint16_t to, uint16_t from, int size)
     {
-        for (int i = 0; i < size; i++)
-            data[i] = readMem(org + i);
+        eachMove(to, from, size, [&](auto dst, auto src, auto n, bool back) {
+            auto ps = hi(src);
+            auto pd = hi(dst);
+            if (pages->wcallbacks[pd] == &write_shared) unshare(pd);
+            if (pages->rhooked[ps] || pages->whooked[pd]) {
+                for (unsigned k = 0; k < n; k++) {
+                    auto j = back ? n - 1 - k : k;
+                    auto v = pages->rhooked[ps]
+                                 ? pages->rcallbacks[ps](*this, src + j)
+                                 : pages->rbank[ps][lo(src + j)];
+                    if (pages->whooked[pd])
+                        pages->wcallbacks[pd](*this, dst + j, v);
+                    else
+                        pages->wbank[pd][lo(dst + j)] = v;
+                }
+            } else
+                std::memmove(pages->wbank[pd] + lo(dst),
+                             pages->rbank[ps] + lo(src), n);
+            touched(pd);
+        });
+        codeWritten(to, size);
     }
 
     // Map ROM to a bank
     void mapRom(uint8_t bank, const Word* data, int len)
     {
+        codeWritten(bank << 8, len);
         auto end = data + len;
         while (data < end) {
-            rbank[bank++] = const_cast<Word*>(data);
+            pages->rbank[bank++] = const_cast<Word*>(data);
             data += 256;
         }
     }
 
+    // Map a ROM file to banks from `bank`, without copying it
+    void mapRom(uint8_t bank, const RomFile& rom)
+    {
+        mapRom(bank, rom.data(), rom.size());
+    }
+
+    // Reads may change a device, like acknowledging an interrupt
+    using ReadCallback = Word (*)(Machine&, uint16_t);
+    using WriteCallback = void (*)(Machine&, uint16_t, Word);
+
+    // With `steady` set, reads only change when an event runs, so loops
+    // polling them can be skipped (see `POLICY::SkipIdleLoops`)
     void mapReadCallback(uint8_t bank, int len,
-                         uint8_t (*cb)(const Machine&, uint16_t a))
+                         uint8_t (*cb)(Machine&, uint16_t a),
+                         bool steady = false)
     {
         while (len > 0) {
-            rcallbacks[bank++] = cb;
+            pages->steady[bank] = steady;
+            setReadCallback(bank++, cb);
             len -= 256;
         }
+        idle = {};
     }
     void mapWriteCallback(uint8_t bank, int len,
                           void (*cb)(Machine&, uint16_t a, uint8_t v))
     {
         while (len > 0) {
-            wcallbacks[bank++] = cb;
+            unshare(bank);
+            setWriteCallback(bank++, cb);
             len -= 256;
         }
     }
 
+    // Map a device to `len` bytes from `start`, for IO pages that are
+    // shared by several devices. Each byte of a page knows its device, so
+    // there is no decoding of the adress per access. If `mirror` is set,
+    // the first `mirror` bytes repeat over the range and the device is
+    // called with the adress in the first copy. A null callback means RAM
+    // in that direction (also mirrored). `steady` is as for
+    // `mapReadCallback()`. At most 255 devices can be mapped.
+    void mapIO(uint16_t start, unsigned len, ReadCallback read,
+               WriteCallback write, unsigned mirror = 0, bool steady = false)
+    {
+        if (len == 0) return;
+        auto& map = *pages;
+        if (map.devices.empty())
+            map.devices.push_back({&read_bank, &write_bank, true});
+        if (map.devices.size() > 255)
+            throw std::length_error("Too many IO devices");
+        auto id = static_cast<uint8_t>(map.devices.size());
+        map.devices.push_back({read ? read : &read_bank,
+                               write ? write : &write_bank, steady});
+        if (!mirror) mirror = len;
+        for (unsigned i = 0; i < len; i++) {
+            auto adr = (start + i) & 0xffff;
+            auto p = hi(adr);
+            if (!map.io[p]) {
+                map.io[p] = std::make_unique<IoPage>();
+                auto& page = *map.io[p];
+                page.device.fill(0);
+                for (unsigned b = 0; b < 256; b++)
+                    page.adr[b] = (p << 8) | b;
+                unshare(p);
+                setReadCallback(p, &read_io);
+                setWriteCallback(p, &write_io);
+            }
+            map.io[p]->device[lo(adr)] = id;
+            map.io[p]->adr[lo(adr)] = start + i % mirror;
+        }
+        for (unsigned p = hi(start); p <= hi(start + len - 1); p++) {
+            const auto& page = *map.io[p & 0xff];
+            map.steady[p & 0xff] = std::all_of(
+                page.device.begin(), page.device.end(),
+                [&](uint8_t d) { return map.devices[d].steady; });
+        }
+        idle = {};
+    }
+
+    // Bank configurations. A machine starts with configuration 0; The map
+    // functions above change the selected one. Set up each configuration
+    // once, and switch between them with `setConfig()`, which only swaps
+    // a pointer. `fork()` copies the selected configuration only.
+
+    // Add a configuration that is a copy of the selected one, and return
+    // its number
+    unsigned addConfig()
+    {
+        for (unsigned p = 0; p < 256; p++)
+            unshare(p);
+        auto map = std::make_unique<PageMap>(*pages);
+        configs.push_back(std::move(map));
+        // Keep `pages` valid across the reallocation
+        pages = configs[selected].get();
+        return configs.size() - 1;
+    }
+
+    void setConfig(unsigned n)
+    {
+        if (n >= configs.size())
+            throw std::out_of_range("No bank configuration " +
+                                    std::to_string(n));
+        auto* to = configs[n].get();
+        if constexpr (POLICY::Dispatch == PREDECODED ||
+                      POLICY::Dispatch == JIT) {
+            for (unsigned p = 0; p < 256; p++)
+                if (to->rbank[p] != pages->rbank[p] ||
+                    to->rcallbacks[p] != pages->rcallbacks[p])
+                    codeWritten(p << 8, 256);
+        }
+        pages = to;
+        selected = n;
+        idle = {};
+    }
+
+    unsigned config() const { return selected; }
+
     uint8_t regA() const { return a; }
     uint8_t regX() const { return x; }
     uint8_t regY() const { return y; }
@@ -193,22 +550,271 @@ template <typename POLICY = DefaultPolicy> struct Machine
 
     uint8_t regSR() const { return get_SR(); }
 
-    void setPC(const int16_t& p) { pc = p; }
+    void setPC(uint16_t p) { pc = p; }
+    void setA(uint8_t v) { a = v; }
+    void setX(uint8_t v) { x = v; }
+    void setY(uint8_t v) { y = v; }
+    void setSP(uint8_t v) { sp = v; }
+    void setSR(uint8_t v) { set_SR(v); }
+
+    // Clear RAM and registers. Mapped ROM and callbacks are kept.
+    void reset()
+    {
+        for (unsigned p = 0; p < 256; p++)
+            unshare(p);
+        ram.clear();
+        dirtyPages.fill(1);
+        codeWritten(0, POLICY::MemSize);
+        a = x = y = 0;
+        sp = 0xff;
+        set_SR(0x30);
+        pc = 0;
+    }
+
+    // Replace all RAM with `image`. Machines loaded from the same image
+    // share its memory until they write to it.
+    void load(const MemoryImage& image)
+    {
+        for (unsigned p = 0; p < 256; p++)
+            unshare(p);
+        ram.load(image);
+        dirtyPages.fill(1);
+        codeWritten(0, POLICY::MemSize);
+    }
 
+    // Keep RAM in `fileName` (see `GuestMemory::mapFile()`); Its current
+    // contents become the RAM. RAM stays at the same adress, so banks and
+    // the access modes are unchanged.
+    void mapRam(const std::string& fileName)
+    {
+        for (unsigned p = 0; p < 256; p++)
+            unshare(p);
+        ram.mapFile(fileName);
+        dirtyPages.fill(1);
+        codeWritten(0, POLICY::MemSize);
+    }
+
+    // Write file backed RAM to disk
+    void syncRam() { ram.sync(); }
+
+    // Save RAM, registers, the cycle count, scheduled events, interrupt
+    // lines and the selected bank configuration, for `restore()`. Call it
+    // between runs.
+    void snapshot()
+    {
+        static_assert(POLICY::Snapshots, "Set Snapshots in the policy");
+        if (!saved) saved = std::make_unique<Snapshot>();
+        saved->ram.resize(POLICY::MemSize);
+        for (unsigned p = 0; p < POLICY::MemSize / 256; p++)
+            std::copy_n(pageData(p), 256, &saved->ram[p * 256]);
+        saved->regs = {a, x, y, sr, result, cres, vres, pc};
+        saved->sp = sp;
+        saved->jumpTable = jumpTable;
+        saved->cycles = totalCycles();
+        saved->events = events;
+        saved->interrupts = {irqLine, nmiPending, interruptCheck};
+        saved->config = selected;
+        dirtyPages.fill(0);
+    }
+
+    // Go back to the last snapshot. Only pages written to since then are
+    // copied back; Writes through `Ram()` are not tracked. The contents of
+    // the bank configurations are not saved, only which one is selected.
+    void restore()
+    {
+        static_assert(POLICY::Snapshots, "Set Snapshots in the policy");
+        if (!saved) throw std::logic_error("restore() without snapshot()");
+        setConfig(saved->config);
+        // The stack is written to directly
+        dirtyPages[1] = 1;
+        for (unsigned p = 0; p < 256; p++) {
+            if (!dirtyPages[p]) continue;
+            unshare(p);
+            auto offs = (p * 256) % POLICY::MemSize;
+            std::copy_n(&saved->ram[offs], 256, &ram[offs]);
+            codeWritten(p << 8, 256);
+            dirtyPages[p] = 0;
+        }
+        std::tie(a, x, y, sr, result, cres, vres, pc) = saved->regs;
+        sp = saved->sp;
+        baseCycles = saved->cycles;
+        cycles = stopCycles = 0;
+        events = saved->events;
+        std::tie(irqLine, nmiPending, interruptCheck) = saved->interrupts;
+        if (jumpTable != saved->jumpTable) {
+            if (saved->jumpTable == &jumpTable_bcd[0])
+                setDec<true>();
+            else
+                setDec<false>();
+        }
+    }
+
+    // Create a machine in the same state, that shares RAM pages with this
+    // one until either of them writes to a page. Banks, callbacks, events
+    // and the decimal mode are copied, and independent after the fork.
+    // Shared pages are only reached through `rbank`, so reads can not
+    // be DIRECT and writes must be CALLBACK or HYBRID.
+    std::unique_ptr<Machine> fork()
+    {
+        static_assert(POLICY::MemSize == 0x10000);
+        static_assert(POLICY::PC_AccessMode != DIRECT &&
+                      POLICY::Read_AccessMode != DIRECT &&
+                      (POLICY::Write_AccessMode == CALLBACK ||
+                       POLICY::Write_AccessMode == HYBRID));
+        static const auto zeroPage = std::make_shared<const Page>();
+
+        auto m = std::make_unique<Machine>();
+        auto& from = *pages;
+        auto& to = *m->pages;
+        to.devices = from.devices;
+        for (unsigned p = 0; p < 256; p++) {
+            const auto* data = pageData(p);
+            // Reads go to RAM and not to a mapped ROM
+            bool inRam = from.rbank[p] == data;
+            m->setReadCallback(p, from.rcallbacks[p]);
+            m->setWriteCallback(p, from.wcallbacks[p]);
+            to.steady[p] = from.steady[p];
+            if (from.io[p]) to.io[p] = std::make_unique<IoPage>(*from.io[p]);
+            if (!inRam) to.rbank[p] = from.rbank[p];
+            // The stack is written directly, and IO callbacks may use
+            // `Ram()`, so those pages are copied right away
+            if (p == 1 || (from.wcallbacks[p] != &write_bank &&
+                           from.wcallbacks[p] != &write_shared)) {
+                std::copy_n(data, 256, &m->ram[p * 256]);
+                continue;
+            }
+            if (!from.shared[p]) {
+                if (std::all_of(data, data + 256, [](Word w) { return w == 0; }))
+                    from.shared[p] = zeroPage;
+                else {
+                    auto page = std::make_shared<Page>();
+                    std::copy_n(data, 256, page->data.begin());
+                    from.shared[p] = page;
+                }
+                setWriteCallback(p, &write_shared);
+            }
+            to.shared[p] = from.shared[p];
+            m->borrowed[p] = 1;
+            if (inRam) to.rbank[p] = from.shared[p]->data.data();
+            m->setWriteCallback(p, &write_shared);
+        }
+        std::tie(m->a, m->x, m->y, m->sr, m->result, m->cres, m->vres,
+                 m->pc, m->sp) =
+            std::tie(a, x, y, sr, result, cres, vres, pc, sp);
+        if (jumpTable == &jumpTable_bcd[0]) m->template setDec<true>();
+        m->baseCycles = totalCycles();
+        m->events = events;
+        std::tie(m->irqLine, m->nmiPending, m->interruptCheck) =
+            std::tie(irqLine, nmiPending, interruptCheck);
+        return m;
+    }
+
+    // Number of pages still shared with other machines
+    unsigned sharedPages() const
+    {
+        unsigned n = 0;
+        for (const auto& s : pages->shared)
+            n += s != nullptr;
+        return n;
+    }
+
+    // Run until `toCycles` cycles have passed, or until stopped by `stop()`,
+    // `eachOp` or a return from the top of the stack. Scheduled events
+    // are run as they become due. Returns the cycles used.
     uint32_t run(uint32_t toCycles = 0x01000000)
     {
-        auto& p = policy();
+        // Cycles stalled since the last run
+        baseCycles += cycles >= Stopped ? stopCycles : cycles;
         cycles = 0;
+        // Registers may have been set from outside since the last run
+        if (irqLine) checkInterrupts();
         while (cycles < toCycles) {
-            if (POLICY::eachOp(p)) break;
-            auto code = ReadPC();
-            auto& op = jumpTable[code];
-            op.op(*this);
-            cycles += op.cycles;
+            // Events and interrupts may change what a loop reads
+            if constexpr (POLICY::SkipIdleLoops) idle = {};
+            if (interruptCheck) interrupt();
+            cycleLimit = nextLimit(toCycles);
+            if (!dispatch()) break;
+            runEvents();
         }
-        return 0;
+        auto used = cycles >= Stopped ? stopCycles : cycles;
+        baseCycles += used;
+        cycles = 0;
+        return used;
+    }
+
+    // Make `run()` return after the current opcode or event
+    void stop()
+    {
+        if (cycles >= Stopped) return;
+        stopCycles = cycles;
+        cycles = Stopped;
     }
 
+    // Add `n` cycles for a device that holds the CPU, like a DMA transfer.
+    // Events that become due run after the current opcode.
+    void stall(unsigned n)
+    {
+        if (cycles >= Stopped)
+            stopCycles += n;
+        else
+            cycles += n;
+    }
+
+    using EventFunc = void (*)(Machine&);
+
+    // Cycles run since the machine was created; The timebase for events
+    uint64_t totalCycles() const
+    {
+        return baseCycles + (cycles >= Stopped ? stopCycles : cycles);
+    }
+
+    // Call `fn` at the first opcode boundary at or after cycle `when` (as
+    // counted by `totalCycles()`). Events that are due at the same cycle
+    // run in no particular order.
+    void schedule(uint64_t when, EventFunc fn)
+    {
+        events.push_back({when, fn});
+        std::push_heap(events.begin(), events.end(), Event::later);
+        // Scheduled while running; Dispatch must end in time
+        auto due = when > baseCycles ? when - baseCycles : 0;
+        if (due < cycleLimit) cycleLimit = std::max<uint64_t>(due, cycles);
+    }
+
+    // Set the level of the IRQ line. An IRQ is taken before the next opcode
+    // for as long as the line is high and the I flag is clear.
+    void irq(bool level)
+    {
+        irqLine = level;
+        if (level) checkInterrupts();
+    }
+
+    // Signal an NMI. It is taken before the next opcode, even if the I flag
+    // is set.
+    void nmi()
+    {
+        nmiPending = true;
+        checkInterrupts();
+    }
+
+    struct RunStats
+    {
+        // Idle loops fast forwarded, and the cycles skipped
+        uint64_t idleSkips = 0;
+        uint64_t idleCycles = 0;
+    };
+    const RunStats& runStats() const { return stats; }
+
+    // Remove all scheduled calls to `fn`
+    void cancel(EventFunc fn)
+    {
+        events.erase(std::remove_if(events.begin(), events.end(),
+                                    [&](auto& e) { return e.fn == fn; }),
+                     events.end());
+        std::make_heap(events.begin(), events.end(), Event::later);
+    }
+
+    const OpcodeProfile& opcodeProfile() const { return *profile; }
+
     auto regs() const { return std::make_tuple(a, x, y, sr, sp, pc); }
     auto regs() { return std::tie(a, x, y, sr, sp, pc); }
 
@@ -231,45 +837,516 @@ private:
     unsigned x;
     unsigned y;
 
-    // Status Register _except_for S and Z flags
+    // Status Register _except_for S and Z flags (and C and V if
+    // `POLICY::LazyFlags` is set)
     unsigned sr;
     // Result of last operation; Used for S and Z flags.
     // result & 0xff == 0 => Z flag is set
     // result & 0x280 !- 0 => S flag is set
     unsigned result;
+    // Used for C and V flags when `POLICY::LazyFlags` is set
+    // cres & 0x100 != 0 => C flag is set
+    // vres & 0x80 != 0 => V flag is set
+    unsigned cres;
+    unsigned vres;
 
     uint8_t sp;
 
-    uint32_t cycles;
+    uint32_t cycles = 0;
+
+    // `cycles` is set to `Stopped` to stop `run`, and the cycles used so far
+    // are kept in `stopCycles`
+    static constexpr uint32_t Stopped =
+        std::numeric_limits<uint32_t>::max() - 32;
+    uint32_t stopCycles;
+
+    // Where dispatch returns to `run`; The next event or the end of the run
+    uint32_t cycleLimit = 0;
+    // Threaded opcodes never chain for longer than this
+    static constexpr uint32_t ThreadedSlice = 4096;
+
+    // Cycles run before the current `run()`
+    uint64_t baseCycles = 0;
+
+    struct Event
+    {
+        uint64_t when;
+        EventFunc fn;
+        static bool later(const Event& a, const Event& b)
+        {
+            return a.when > b.when;
+        }
+    };
+    // Heap with the next event first
+    std::vector<Event> events;
+
+    uint32_t nextLimit(uint32_t toCycles) const
+    {
+        if (events.empty()) return toCycles;
+        auto when = events.front().when;
+        if (when <= baseCycles + cycles) return cycles;
+        return std::min<uint64_t>(toCycles, when - baseCycles);
+    }
+
+    // Interrupt lines. They are only looked at when `interruptCheck` is set,
+    // which happens when a line goes high or the I flag is cleared.
+    bool irqLine = false;
+    bool nmiPending = false;
+    bool interruptCheck = false;
+
+    // Make dispatch return to `run` after the current opcode, so a
+    // pending interrupt can be taken
+    void checkInterrupts()
+    {
+        interruptCheck = true;
+        cycleLimit = std::min(cycleLimit, cycles);
+    }
+
+    void interrupt()
+    {
+        interruptCheck = false;
+        Adr vector;
+        if (nmiPending) {
+            nmiPending = false;
+            vector = 0xfffa;
+        } else if (irqLine && !(sr & (1 << IRQ)))
+            vector = 0xfffe;
+        else
+            return;
+        // Like BRK, but with the B flag clear
+        stack[sp] = pc >> 8;
+        stack[(sp - 1) & 0xff] = pc & 0xff;
+        stack[(sp - 2) & 0xff] = get_SR() & ~0x10;
+        sp -= 3;
+        sr |= 1 << IRQ;
+        pc = Read16(vector);
+        cycles += 7;
+    }
+
+    RunStats stats;
+
+    // The last backwards jump; From `end` to `head`, with the registers
+    // and cycles when it was taken
+    struct IdleLoop
+    {
+        unsigned head = ~0u;
+        unsigned end = 0;
+        uint32_t at = 0;
+        std::tuple<unsigned, unsigned, unsigned, unsigned, unsigned, unsigned,
+                   unsigned, uint8_t>
+            regs;
+        // Last loop found not to be idle
+        unsigned rejected = ~0u;
+    } idle;
+
+    // Called after jumping back from `end` to `pc`. If the registers are
+    // the same as the last time we took the same jump, and the loop can
+    // not change anything, it will keep running the same way until the
+    // next event. Whole rounds of it are then skipped.
+    void loopBack(unsigned end)
+    {
+        auto regs = std::make_tuple(a, x, y, sr, result, cres, vres, sp);
+        if (pc == idle.head && end == idle.end && regs == idle.regs &&
+            pc != idle.rejected) {
+            auto round = cycles - idle.at;
+            if (!idleLoop(pc, end))
+                idle.rejected = pc;
+            else if (round > 0 && cycles + 4 < cycleLimit) {
+                // The cycles of the jump itself may not be counted yet, so
+                // keep clear of the limit and run the last round normally
+                auto skip = (cycleLimit - cycles - 4) / round * round;
+                cycles += skip;
+                stats.idleSkips++;
+                stats.idleCycles += skip;
+            }
+        }
+        idle.head = pc;
+        idle.end = end;
+        idle.at = cycles;
+        idle.regs = regs;
+    }
+
+    bool steadyPage(unsigned p) const
+    {
+        if constexpr (POLICY::Read_AccessMode == DIRECT ||
+                      POLICY::Read_AccessMode == BANKED)
+            return true;
+        if constexpr (POLICY::Read_AccessMode == DEVICES)
+            return POLICY::Devices::steady(p & 0xff);
+        p &= 0xff;
+        return !pages->rhooked[p] || pages->steady[p];
+    }
+
+    // True if the code from `head` to `end` only changes registers, reads
+    // steady memory and stays inside itself
+    bool idleLoop(unsigned head, unsigned end)
+    {
+        static const auto idleOps = [] {
+            std::array<bool, 256> ops{};
+            for (unsigned code = 0; code < 256; code++) {
+                const auto* name = opcodeInfo[code].name;
+                if (!name) continue;
+                for (auto* n : {"lda", "ldx", "ldy", "cmp", "cpx", "cpy",
+                                "bit", "and", "ora", "eor", "adc", "sbc",
+                                "tax", "tay", "txa", "tya", "tsx", "inx",
+                                "iny", "dex", "dey", "clc", "sec", "clv",
+                                "nop", "jmp"})
+                    if (strcmp(name, n) == 0) ops[code] = true;
+                if (opcodeInfo[code].mode == REL) ops[code] = true;
+            }
+            return ops;
+        }();
+        for (auto adr = head; adr < end;) {
+            auto code = Read<POLICY::PC_AccessMode>(adr);
+            const auto& info = opcodeInfo[code];
+            if (!idleOps[code]) return false;
+            auto arg = Read<POLICY::PC_AccessMode>(adr + 1);
+            auto hi = Read<POLICY::PC_AccessMode>(adr + 2);
+            switch (info.mode) {
+            case NONE:
+            case IMM: break;
+            case REL: {
+                auto to = adr + 2 + static_cast<int8_t>(arg);
+                if (to < head || to > end) return false;
+                break;
+            }
+            case ZP:
+            case ZPX:
+            case ZPY:
+                if (!steadyPage(0)) return false;
+                break;
+            case ABS:
+                // Only the jump back itself
+                if (code == 0x4c) {
+                    if (adr + 3 != end) return false;
+                } else if (!steadyPage(hi))
+                    return false;
+                break;
+            case ABSX:
+            case ABSY:
+                if (!steadyPage(hi) || !steadyPage(hi + 1)) return false;
+                break;
+            default: return false;
+            }
+            adr += info.size;
+        }
+        return true;
+    }
+
+    void runEvents()
+    {
+        while (cycles < Stopped && !events.empty() &&
+               events.front().when <= baseCycles + cycles) {
+            auto fn = events.front().fn;
+            std::pop_heap(events.begin(), events.end(), Event::later);
+            events.pop_back();
+            fn(*this);
+        }
+    }
+
+    // Run opcodes until `cycleLimit`. Returns false if stopped by `eachOp`.
+    bool dispatch()
+    {
+        auto& p = policy();
+        if constexpr (POLICY::Dispatch == THREADED) {
+            // Tail calls are not guaranteed (ie in debug builds), so never
+            // chain more than a slice of cycles before returning here
+            auto limit = cycleLimit;
+            while (cycles < limit) {
+                if (POLICY::eachOp(p)) return false;
+                auto slice = std::min(limit, cycles + ThreadedSlice);
+                cycleLimit = slice;
+                auto& op = jumpTable[ReadPC()];
+                op.thread(*this, op.cycles);
+                // A lower limit means an event was scheduled
+                if (cycleLimit < slice) return true;
+                // Returning before the limit means `eachOp` stopped us
+                if (cycles < cycleLimit) return false;
+            }
+        } else if constexpr (POLICY::Dispatch == JIT) {
+            jit->run(*this, cycleLimit);
+            return cycles >= cycleLimit;
+        } else if constexpr (POLICY::Dispatch == PREDECODED) {
+            while (cycles < cycleLimit) {
+                if (POLICY::eachOp(p)) return false;
+                const auto* d = &decoded[pc];
+                if (d->gen != decodeGen) d = &decode(pc);
+                operand = d->operand;
+                pc += d->size;
+                d->op(*this);
+                cycles += d->cycles;
+            }
+        } else {
+            while (cycles < cycleLimit) {
+                if (POLICY::eachOp(p)) return false;
+                auto code = ReadPC();
+                if constexpr (POLICY::ProfileOpcodes) profile->add(code);
+                auto& op = jumpTable[code];
+                op.op(*this);
+                cycles += op.cycles;
+            }
+        }
+        return true;
+    }
 
     // Current jumptable
     const Opcode* jumpTable;
 
+    // Operand of the current opcode when running PREDECODED
+    unsigned operand;
+
+    // An opcode decoded at a specific adress. Only valid if `gen` matches
+    // `decodeGen`, which changes with the decimal flag.
+    struct Decoded
+    {
+        OpFunc op;
+        uint16_t operand;
+        uint8_t cycles;
+        uint8_t size;
+        uint32_t gen;
+    };
+
+    std::vector<Decoded> decoded;
+    // Pages that (may) contain decoded or compiled opcodes
+    std::array<uint8_t, 256> decodedPages;
+    uint32_t decodeGen;
+
+    // Compiled code when running JIT. Set when compiled code is written to.
+    friend struct Jit<Machine>;
+    std::shared_ptr<Jit<Machine>> jit;
+    bool codeDirty;
+
+    std::unique_ptr<OpcodeProfile> profile;
+
+    // Pages written to since the last snapshot
+    std::array<uint8_t, 256> dirtyPages;
+
+    struct Snapshot
+    {
+        std::vector<Word> ram;
+        std::tuple<unsigned, unsigned, unsigned, unsigned, unsigned, unsigned,
+                   unsigned, unsigned>
+            regs;
+        uint8_t sp;
+        const Opcode* jumpTable;
+        uint64_t cycles;
+        std::vector<Event> events;
+        std::tuple<bool, bool, bool> interrupts;
+        unsigned config;
+    };
+    std::unique_ptr<Snapshot> saved;
+
+    // A RAM page shared by forked machines. Pages are never written to;
+    // Writing to a shared page drops it from `shared`. If `borrowed` is set,
+    // the page is read from `shared` and first copied to `ram` when written.
+    struct Page
+    {
+        std::array<Word, 256> data;
+    };
+    std::array<uint8_t, 256> borrowed;
+
+    const Word* pageData(unsigned p) const
+    {
+        return borrowed[p] ? pages->shared[p]->data.data()
+                           : &ram[(p * 256) % POLICY::MemSize];
+    }
+
+    // Call `fn(adr, offset, n)` for each part of a range that is within
+    // one page
+    template <typename FN> static void eachPage(unsigned org, int size, FN fn)
+    {
+        for (unsigned i = 0; i < (unsigned)size;) {
+            auto adr = (org + i) & 0xffff;
+            auto n = std::min<unsigned>(size - i, 256 - lo(adr));
+            fn(adr, i, n);
+            i += n;
+        }
+    }
+
+    // Call `fn(to, from, n, backwards)` for each part of a move that is
+    // within one page at both ends. If the destination starts inside the
+    // source, the parts come from the end, and are copied backwards.
+    template <typename FN>
+    static void eachMove(unsigned to, unsigned from, int size, FN fn)
+    {
+        bool back = to != from && ((to - from) & 0xffff) < (unsigned)size;
+        for (unsigned i = 0; i < (unsigned)size;) {
+            auto left = size - i;
+            auto src = (from + (back ? left - 1 : i)) & 0xffff;
+            auto dst = (to + (back ? left - 1 : i)) & 0xffff;
+            unsigned n;
+            if (back) {
+                n = std::min({left, lo(src) + 1, lo(dst) + 1});
+                src -= n - 1;
+                dst -= n - 1;
+            } else
+                n = std::min({left, 256 - lo(src), 256 - lo(dst)});
+            fn(dst, src, n, back);
+            i += n;
+        }
+    }
+
+    Word* ownPage(unsigned p) { return &ram[(p * 256) % POLICY::MemSize]; }
+
+    void unshare(unsigned p)
+    {
+        if (!pages->shared[p]) return;
+        if (borrowed[p]) {
+            auto* own = &ram[(p * 256) % POLICY::MemSize];
+            std::copy_n(pages->shared[p]->data.begin(), 256, own);
+            if (pages->rbank[p] == pages->shared[p]->data.data())
+                pages->rbank[p] = own;
+            borrowed[p] = 0;
+        }
+        pages->shared[p].reset();
+        if (pages->wcallbacks[p] == &write_shared)
+            setWriteCallback(p, &write_bank);
+    }
+
+    void setReadCallback(unsigned p, ReadCallback cb)
+    {
+        pages->rcallbacks[p] = cb;
+        pages->rhooked[p] = cb != &read_bank;
+    }
+
+    void setWriteCallback(unsigned p, WriteCallback cb)
+    {
+        pages->wcallbacks[p] = cb;
+        pages->whooked[p] = cb != &write_bank;
+    }
+
+    // Policies that take a `Machine&` are constructed with it; others are
+    // default constructed
+    static POLICY makePolicy(Machine& m)
+    {
+        if constexpr (std::is_constructible_v<POLICY, Machine&>)
+            return POLICY(m);
+        else
+            return POLICY();
+    }
+
+    // Each machine has its own policy, so that machines can run on
+    // different threads
+    POLICY policyState = makePolicy(*this);
+
     // Stack normally points to ram[0x100];
     Word* stack;
 
     // 6502 RAM
-    std::array<Word, POLICY::MemSize> ram;
+    friend struct DeviceAccess;
+    GuestMemory ram{POLICY::MemSize};
 
-    // Banks normally point to corresponding ram
-    std::array<const Word*, 256> rbank;
-    std::array<Word*, 256> wbank;
+    struct IoDevice
+    {
+        ReadCallback read;
+        WriteCallback write;
+        bool steady;
+    };
 
-    std::array<Word (*)(const Machine&, uint16_t), 256> rcallbacks;
-    std::array<void (*)(Machine&, uint16_t, Word), 256> wcallbacks;
+    // The device of each byte in an IO page, and the adress it is called
+    // with
+    struct IoPage
+    {
+        std::array<uint8_t, 256> device;
+        std::array<uint16_t, 256> adr;
+    };
 
+    // Mapping of each page, kept on the heap so moving a machine is cheap
+    struct PageMap
+    {
+        // Banks normally point to corresponding ram
+        std::array<const Word*, 256> rbank;
+        std::array<Word*, 256> wbank;
+
+        std::array<ReadCallback, 256> rcallbacks;
+        std::array<WriteCallback, 256> wcallbacks;
+
+        // Banks with a callback other than `read_bank` and `write_bank`;
+        // The only ones that go through the callback when HYBRID
+        std::array<bool, 256> rhooked{};
+        std::array<bool, 256> whooked{};
+
+        std::array<std::shared_ptr<const Page>, 256> shared;
+
+        // Read callbacks that only change when an event runs
+        std::array<bool, 256> steady{};
+
+        // Devices mapped by `mapIO()`; The first one is RAM
+        std::vector<IoDevice> devices;
+        std::array<std::unique_ptr<IoPage>, 256> io;
+
+        PageMap() = default;
+        PageMap(const PageMap& op)
+            : rbank(op.rbank), wbank(op.wbank), rcallbacks(op.rcallbacks),
+              wcallbacks(op.wcallbacks), rhooked(op.rhooked),
+              whooked(op.whooked), shared(op.shared), steady(op.steady),
+              devices(op.devices)
+        {
+            for (unsigned p = 0; p < 256; p++)
+                if (op.io[p]) io[p] = std::make_unique<IoPage>(*op.io[p]);
+        }
+    };
+    std::vector<std::unique_ptr<PageMap>> configs = [] {
+        std::vector<std::unique_ptr<PageMap>> v;
+        v.push_back(std::make_unique<PageMap>());
+        return v;
+    }();
+    PageMap* pages = configs[0].get();
+    unsigned selected = 0;
+
+    template <bool USE_BCD> static constexpr std::array<Opcode, 256> makeJumpTable()
+    {
+        std::array<Opcode, 256> t{};
+        for (const auto& d : instructionTable<USE_BCD>)
+            t[d.code] = Opcode(d.code, d.cycles, d.mode, d.handler);
+        if constexpr (POLICY::Superinstructions && !USE_BCD) {
+            static_assert(POLICY::Dispatch == TABLE ||
+                          POLICY::Dispatch == THREADED);
+            // Decimal mode ADC/SBC are not fused, so only the normal table
+            for (const auto& o : superinstructions)
+                t[o.code] = o;
+        }
+        return t;
+    }
 
-    std::array<Opcode, 256> jumpTable_normal;
-    std::array<Opcode, 256> jumpTable_bcd;
+    static constexpr std::array<OpcodeInfo, 256> makeOpcodeInfo()
+    {
+        std::array<OpcodeInfo, 256> t{};
+        // The first entry wins, so shifts have no operand
+        for (const auto& d : instructionTable<false>)
+            if (!t[d.code].name)
+                t[d.code] = {d.name, d.cycles, d.mode, (uint8_t)opSize(d.mode)};
+        return t;
+    }
 
     static void write_bank(Machine& m, uint16_t adr, Word v)
     {
-        m.wbank[adr >> 8][adr & 0xff] = v & 0xff;
+        m.pages->wbank[adr >> 8][adr & 0xff] = v & 0xff;
+    }
+
+    static void write_shared(Machine& m, uint16_t adr, Word v)
+    {
+        m.unshare(adr >> 8);
+        write_bank(m, adr, v);
+    }
+
+    static Word read_bank(Machine& m, uint16_t adr)
+    {
+        return m.pages->rbank[adr >> 8][adr & 0xff];
     }
 
-    static Word read_bank(const Machine& m, uint16_t adr)
+    static Word read_io(Machine& m, uint16_t adr)
     {
-        return m.rbank[adr >> 8][adr & 0xff];
+        const auto& page = *m.pages->io[adr >> 8];
+        auto i = adr & 0xff;
+        return m.pages->devices[page.device[i]].read(m, page.adr[i]);
+    }
+
+    static void write_io(Machine& m, uint16_t adr, Word v)
+    {
+        const auto& page = *m.pages->io[adr >> 8];
+        auto i = adr & 0xff;
+        m.pages->devices[page.device[i]].write(m, page.adr[i], v);
     }
 
     template <int REG> constexpr auto& Reg() const
@@ -322,9 +1399,14 @@ private:
     static constexpr auto SZC = S | Z | C;
     static constexpr auto SZCV = S | Z | C | V;
 
+    static constexpr bool LazyFlags = POLICY::LazyFlags;
+
     uint8_t get_SR() const
     {
-        return sr | ((result | (result >> 2)) & 0x80) | (!(result & 0xff) << 1);
+        auto s = sr;
+        if constexpr (LazyFlags)
+            s = (s & ~(C | V)) | carry() | ((vres >> 1) & V);
+        return s | ((result | (result >> 2)) & 0x80) | (!(result & 0xff) << 1);
     }
 
     template <bool DEC> void setDec()
@@ -333,6 +1415,14 @@ private:
             jumpTable = &jumpTable_bcd[0];
         else
             jumpTable = &jumpTable_normal[0];
+        // ADC and SBC now needs other opcode functions
+        if constexpr (POLICY::Dispatch == PREDECODED) {
+            if (++decodeGen == 0) {
+                for (auto& d : decoded)
+                    d.gen = 0;
+                decodeGen = 1;
+            }
+        }
     }
 
     void set_SR(uint8_t s)
@@ -346,12 +1436,24 @@ private:
         }
         result = ((s << 2) & 0x200) | !(s & Z);
         sr = (s & ~SZ) | 0x30;
+        // PLP and RTI may unmask a waiting IRQ
+        if (irqLine && !(s & (1 << IRQ))) checkInterrupts();
+        if constexpr (LazyFlags) {
+            cres = (s & C) << 8;
+            vres = (s & V) << 1;
+        }
     }
 
     template <int BITS> void set(int res, int arg = 0)
     {
         result = res;
 
+        if constexpr (LazyFlags) {
+            if constexpr ((BITS & C) != 0) cres = res;
+            // Overflow if both operands have a different sign than result
+            if constexpr ((BITS & V) != 0) vres = (a ^ res) & (arg ^ res);
+            return;
+        }
         if constexpr ((BITS & (C | V)) != 0) sr &= ~BITS;
         if constexpr ((BITS & C) != 0) sr |= ((res >> 8) & 1); // Apply carry
         if constexpr ((BITS & V) != 0)
@@ -361,13 +1463,39 @@ private:
     static constexpr bool SET = true;
     static constexpr bool CLEAR = false;
 
-    constexpr unsigned carry() const { return sr & 1; }
+    constexpr unsigned carry() const
+    {
+        if constexpr (LazyFlags) return (cres >> 8) & 1;
+        return sr & 1;
+    }
+
+    // Set carry to bit 0 of `c`
+    constexpr void setCarry(unsigned c)
+    {
+        if constexpr (LazyFlags)
+            cres = c << 8;
+        else
+            sr = (sr & 0xfe) | c;
+    }
+
+    // Set overflow to bit 6 of `v`
+    constexpr void setOver(unsigned v)
+    {
+        if constexpr (LazyFlags)
+            vres = v << 1;
+        else
+            sr = (sr & ~V) | v;
+    }
 
     template <int FLAG, bool v> constexpr bool check() const
     {
         if constexpr (FLAG == ZERO) return result & 0xff ? !v : v;
         if constexpr (FLAG == SIGN)
             return result & 0x280 ? v : !v;
+        else if constexpr (LazyFlags && FLAG == CARRY)
+            return (bool)(cres & 0x100) == v;
+        else if constexpr (LazyFlags && FLAG == OVER)
+            return (bool)(vres & 0x80) == v;
         else
             return (bool)(sr & (1 << FLAG)) == v;
     }
@@ -386,14 +1514,20 @@ private:
     }
 
     template <int ACCESS_MODE = POLICY::Read_AccessMode>
-    unsigned Read(unsigned adr) const
+    unsigned Read(unsigned adr)
     {
         if constexpr (ACCESS_MODE == DIRECT)
             return ram[adr];
         else if constexpr (ACCESS_MODE == BANKED)
-            return rbank[hi(adr)][lo(adr)];
+            return pages->rbank[hi(adr)][lo(adr)];
+        else if constexpr (ACCESS_MODE == HYBRID) {
+            if (pages->rhooked[hi(adr)])
+                return pages->rcallbacks[hi(adr)](*this, adr);
+            return pages->rbank[hi(adr)][lo(adr)];
+        } else if constexpr (ACCESS_MODE == DEVICES)
+            return POLICY::Devices::read(*this, adr);
         else
-            return rcallbacks[hi(adr)](*this, adr);
+            return pages->rcallbacks[hi(adr)](*this, adr);
     }
 
     template <int ACCESS_MODE = POLICY::Write_AccessMode>
@@ -402,27 +1536,89 @@ private:
         if constexpr (ACCESS_MODE == DIRECT)
             ram[adr] = v;
         else if constexpr (ACCESS_MODE == BANKED)
-            wbank[hi(adr)][lo(adr)] = v;
+            pages->wbank[hi(adr)][lo(adr)] = v;
+        else if constexpr (ACCESS_MODE == HYBRID) {
+            if (pages->whooked[hi(adr)])
+                pages->wcallbacks[hi(adr)](*this, adr, v);
+            else
+                pages->wbank[hi(adr)][lo(adr)] = v;
+        } else if constexpr (ACCESS_MODE == DEVICES)
+            POLICY::Devices::write(*this, adr, v);
         else
-            wcallbacks[hi(adr)](*this, adr, v);
+            pages->wcallbacks[hi(adr)](*this, adr, v);
+        touched(hi(adr));
+        codeWritten(adr);
     }
 
+    void touched(unsigned page)
+    {
+        if constexpr (POLICY::Snapshots) dirtyPages[page & 0xff] = 1;
+    }
+
+    // Drop decoded or compiled opcodes that overlap the written byte
+    void codeWritten(unsigned adr)
+    {
+        if constexpr (POLICY::Dispatch == PREDECODED) {
+            if (decodedPages[hi(adr) & 0xff]) {
+                for (unsigned i = 0; i < 3; i++)
+                    decoded[(adr - i) % POLICY::MemSize].gen = 0;
+            }
+        }
+        if constexpr (POLICY::Dispatch == JIT) {
+            if (decodedPages[hi(adr) & 0xff]) jit->written(*this, adr);
+        }
+    }
+
+    void codeWritten(unsigned adr, int len)
+    {
+        if constexpr (POLICY::Dispatch == PREDECODED) {
+            for (int i = 0; i < len + 2; i++)
+                decoded[(adr + i - 2) % POLICY::MemSize].gen = 0;
+        }
+        if constexpr (POLICY::Dispatch == JIT) {
+            for (int i = 0; i < len; i++)
+                codeWritten(adr + i);
+        }
+    }
+
+    // Decode the opcode at `adr` into the cache
+    const Decoded& decode(unsigned adr)
+    {
+        auto& d = decoded[adr];
+        const auto& op = jumpTable[Read<POLICY::PC_AccessMode>(adr)];
+        d.op = op.op;
+        d.cycles = op.cycles;
+        d.size = opSize(op.mode);
+        d.operand = 0;
+        if (d.size > 1) d.operand = Read<POLICY::PC_AccessMode>(adr + 1);
+        if (d.size > 2) d.operand |= Read<POLICY::PC_AccessMode>(adr + 2) << 8;
+        d.gen = decodeGen;
+        decodedPages[hi(adr) & 0xff] = 1;
+        decodedPages[hi(adr + d.size - 1) & 0xff] = 1;
+        return d;
+    }
+
+    static constexpr bool Predecoded = POLICY::Dispatch == PREDECODED;
+
     unsigned ReadPC() { return Read<POLICY::PC_AccessMode>(pc++); }
 
+    // When PREDECODED, `pc` has already been moved past the operand
     unsigned ReadPC8(unsigned offs = 0)
     {
+        if constexpr (Predecoded) return (operand + offs) & 0xff;
         return (Read<POLICY::PC_AccessMode>(pc++) + offs) & 0xff;
     }
 
     unsigned ReadPC16(unsigned offs = 0)
     {
+        if constexpr (Predecoded) return operand + offs;
         auto adr = to_adr(Read<POLICY::PC_AccessMode>(pc),
                           Read<POLICY::PC_AccessMode>(pc + 1));
         pc += 2;
         return adr + offs;
     }
 
-    unsigned Read16(unsigned a, unsigned offs = 0) const
+    unsigned Read16(unsigned a, unsigned offs = 0)
     {
         return to_adr(Read(a), Read(a + 1)) + offs;
     }
@@ -430,7 +1626,7 @@ private:
     // Read operand from PC and create effective adress depeding on 'MODE'
     template <int MODE> unsigned ReadEA()
     {
-        if constexpr (MODE == IMM) return pc++;
+        if constexpr (MODE == IMM) return Predecoded ? pc - 1 : pc++;
         if constexpr (MODE == ZP) return ReadPC8();
         if constexpr (MODE == ZPX) return ReadPC8(x);
         if constexpr (MODE == ZPY) return ReadPC8(y);
@@ -444,7 +1640,11 @@ private:
 
     template <int MODE> void StoreEA(unsigned v) { Write(ReadEA<MODE>(), v); }
 
-    template <int MODE> unsigned LoadEA() { return Read(ReadEA<MODE>()); }
+    template <int MODE> unsigned LoadEA()
+    {
+        if constexpr (MODE == IMM && Predecoded) return operand;
+        return Read(ReadEA<MODE>());
+    }
 
     /////////////////////////////////////////////////////////////////////////
     ///
@@ -456,7 +1656,14 @@ private:
     template <int FLAG, bool ON> static constexpr void Set(Machine& m)
     {
         if constexpr (FLAG == DECIMAL) m.setDec<ON>();
-        m.sr = (m.sr & ~(1 << FLAG)) | (ON << FLAG);
+        if constexpr (FLAG == IRQ && !ON)
+            if (m.irqLine) m.checkInterrupts();
+        if constexpr (FLAG == CARRY)
+            m.setCarry(ON);
+        else if constexpr (FLAG == OVER)
+            m.setOver(ON << FLAG);
+        else
+            m.sr = (m.sr & ~(1 << FLAG)) | (ON << FLAG);
     }
 
     template <int REG, int MODE> static constexpr void Store(Machine& m)
@@ -472,13 +1679,13 @@ private:
 
     template <int FLAG, bool ON> static constexpr void Branch(Machine& m)
     {
-        auto pc = m.pc;
-        int8_t diff = m.Read<POLICY::PC_AccessMode>(pc++);
+        int8_t diff = m.ReadPC8();
         if (m.check<FLAG, ON>()) {
-            pc += diff;
+            m.pc += diff;
             m.cycles++;
+            if constexpr (POLICY::SkipIdleLoops)
+                if (diff < 0) m.loopBack(m.pc - diff);
         }
-        m.pc = pc;
     }
 
     template <int MODE, int INC> static constexpr void Inc(Machine& m)
@@ -500,7 +1707,7 @@ private:
     {
         unsigned z = m.LoadEA<MODE>();
         m.result = (z & m.a) | ((z & 0x80) << 2);
-        m.sr = (m.sr & ~V) | (z & V);
+        m.setOver(z & V);
     }
 
     template <int REG, int MODE> static constexpr void Cmp(Machine& m)
@@ -581,13 +1788,13 @@ private:
     template <int MODE> static constexpr void Lsr(Machine& m)
     {
         if constexpr (MODE == A) {
-            m.sr = (m.sr & 0xfe) | (m.a & 1);
+            m.setCarry(m.a & 1);
             m.a >>= 1;
             m.set<SZ>(m.a);
         } else {
             auto adr = m.ReadEA<MODE>();
             unsigned rc = m.Read(adr);
-            m.sr = (m.sr & 0xfe) | (rc & 1);
+            m.setCarry(rc & 1);
             rc >>= 1;
             m.Write(adr, rc);
             m.set<SZ>(rc);
@@ -597,14 +1804,14 @@ private:
     template <int MODE> static constexpr void Ror(Machine& m)
     {
         if constexpr (MODE == A) {
-            unsigned rc = (((m.sr << 8) & 0x100) | m.a) >> 1;
-            m.sr = (m.sr & 0xfe) | (m.a & 1);
+            unsigned rc = ((m.carry() << 8) | m.a) >> 1;
+            m.setCarry(m.a & 1);
             m.a = rc & 0xff;
             m.set<SZ>(m.a);
         } else {
             auto adr = m.ReadEA<MODE>();
-            unsigned rc = m.Read(adr) | ((m.sr << 8) & 0x100);
-            m.sr = (m.sr & 0xfe) | (rc & 1);
+            unsigned rc = m.Read(adr) | (m.carry() << 8);
+            m.setCarry(rc & 1);
             rc >>= 1;
             m.Write(adr, rc);
             m.set<SZ>(rc);
@@ -631,298 +1838,363 @@ private:
         if constexpr (TO != SP) m.set<SZ>(m.Reg<TO>());
     }
 
+    // === STACK & FLOW CONTROL
+
+    static constexpr void Nop(Machine&) {}
+
+    template <int REG> static constexpr void Push(Machine& m)
+    {
+        if constexpr (REG == SR)
+            m.stack[m.sp--] = m.get_SR();
+        else
+            m.stack[m.sp--] = m.Reg<REG>();
+    }
+
+    template <int REG> static constexpr void Pull(Machine& m)
+    {
+        if constexpr (REG == SR)
+            m.set_SR(m.stack[++m.sp]);
+        else
+            m.Reg<REG>() = m.stack[++m.sp];
+    }
+
+    template <int MODE> static constexpr void Jmp(Machine& m)
+    {
+        auto adr = m.ReadEA<MODE>();
+        if constexpr (MODE == ABS && POLICY::SkipIdleLoops) {
+            if (adr < m.pc) {
+                auto end = m.pc;
+                m.pc = adr;
+                m.loopBack(end);
+                return;
+            }
+        }
+        m.pc = adr;
+    }
+
+    static constexpr void Jsr(Machine& m)
+    {
+        auto adr = m.ReadPC16();
+        m.stack[m.sp] = (m.pc - 1) >> 8;
+        m.stack[m.sp - 1] = (m.pc - 1) & 0xff;
+        m.sp -= 2;
+        m.pc = adr;
+    }
+
+    static constexpr void Rts(Machine& m)
+    {
+        if constexpr (POLICY::ExitOnStackWrap) {
+            if (m.sp == 0xff) {
+                m.stop();
+                return;
+            }
+        }
+        m.pc = (m.stack[m.sp + 1] | (m.stack[m.sp + 2] << 8)) + 1;
+        m.sp += 2;
+    }
+
+    static constexpr void Rti(Machine& m)
+    {
+        m.set_SR(m.stack[m.sp + 1]);
+        m.pc = (m.stack[m.sp + 2] | (m.stack[m.sp + 3] << 8));
+        m.sp += 3;
+    }
+
+    static constexpr void Brk(Machine& m)
+    {
+        m.ReadPC();
+        m.stack[m.sp] = m.pc >> 8;
+        m.stack[m.sp - 1] = m.pc & 0xff;
+        m.stack[m.sp - 2] = m.get_SR();
+        m.sp -= 3;
+        m.pc = m.Read16(m.to_adr(0xfe, 0xff));
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    ///
+    ///   THREADED DISPATCH
+    ///
+    /////////////////////////////////////////////////////////////////////////
+
+    // Run opcode function `OP` and add its cycles after it, like table
+    // dispatch does, then fetch the next opcode and jump straight to it
+    template <OpFunc OP> static void Threaded(Machine& m, unsigned cycles)
+    {
+        OP(m);
+        m.cycles += cycles;
+        if (m.cycles >= m.cycleLimit || POLICY::eachOp(m.policy())) return;
+        auto& op = m.jumpTable[m.ReadPC()];
+        return op.thread(m, op.cycles);
+    }
+
+    template <OpFunc OP> static constexpr Handler op{OP, &Threaded<OP>};
+
+    /////////////////////////////////////////////////////////////////////////
+    ///
+    ///   SUPERINSTRUCTIONS
+    ///
+    /////////////////////////////////////////////////////////////////////////
+
+    // An opcode following the first opcode of a superinstruction
+    template <int CODE, OpFunc OP> struct Then
+    {};
+
+    // Run the following opcode directly if it is the expected one
+    template <int CODE, OpFunc OP> bool runNext(Then<CODE, OP>)
+    {
+        if (Read<POLICY::PC_AccessMode>(pc) != CODE) return false;
+        pc++;
+        OP(*this);
+        cycles += jumpTable[CODE].cycles;
+        if constexpr (POLICY::ProfileOpcodes) profile->fused++;
+        return true;
+    }
+
+    // Replaces the opcode function of `OP`, and continues with the `NEXT`
+    // opcodes for as long as they match the code that follows
+    template <OpFunc OP, typename... NEXT> static void Fused(Machine& m)
+    {
+        OP(m);
+        (m.runNext(NEXT{}) && ...);
+    }
+
     /////////////////////////////////////////////////////////////////////////
     ///
     ///   INSTRUCTION TABLE
     ///
     /////////////////////////////////////////////////////////////////////////
 
+    using BNE = Then<0xd0, Branch<ZERO, CLEAR>>;
+    using BCC = Then<0x90, Branch<CARRY, CLEAR>>;
+
 public:
-    template <bool USE_BCD = false> static const auto& getInstructions()
-    {
-        static const  std::vector<Instruction> instructionTable = {
-
-            { "nop", {{ 0xea, 2, NONE, [](Machine& ) {} }} },
-
-            { "lda", {
-                { 0xa9, 2, IMM, Load<A, IMM>},
-                { 0xa5, 2, ZP, Load<A, ZP>},
-                { 0xb5, 4, ZPX, Load<A, ZPX>},
-                { 0xad, 4, ABS, Load<A, ABS>},
-                { 0xbd, 4, ABSX, Load<A, ABSX>},
-                { 0xb9, 4, ABSY, Load<A, ABSY>},
-                { 0xa1, 6, INDX, Load<A, INDX>},
-                { 0xb1, 5, INDY, Load<A, INDY>},
-            } },
-
-            { "ldx", {
-                { 0xa2, 2, IMM, Load<X, IMM>},
-                { 0xa6, 3, ZP, Load<X, ZP>},
-                { 0xb6, 4, ZPY, Load<X, ZPY>},
-                { 0xae, 4, ABS, Load<X, ABS>},
-                { 0xbe, 4, ABSY, Load<X, ABSY>},
-            } },
-
-            { "ldy", {
-                { 0xa0, 2, IMM, Load<Y, IMM>},
-                { 0xa4, 3, ZP, Load<Y, ZP>},
-                { 0xb4, 4, ZPX, Load<Y, ZPX>},
-                { 0xac, 4, ABS, Load<Y, ABS>},
-                { 0xbc, 4, ABSX, Load<Y, ABSX>},
-            } },
-
-            { "sta", {
-                { 0x85, 3, ZP, Store<A, ZP>},
-                { 0x95, 4, ZPX, Store<A, ZPX>},
-                { 0x8d, 4, ABS, Store<A, ABS>},
-                { 0x9d, 4, ABSX, Store<A, ABSX>},
-                { 0x99, 4, ABSY, Store<A, ABSY>},
-                { 0x81, 6, INDX, Store<A, INDX>},
-                { 0x91, 5, INDY, Store<A, INDY>},
-            } },
-
-            { "stx", {
-                { 0x86, 3, ZP, Store<X, ZP>},
-                { 0x96, 4, ZPY, Store<X, ZPY>},
-                { 0x8e, 4, ABS, Store<X, ABS>},
-            } },
-
-            { "sty", {
-                { 0x84, 3, ZP, Store<Y, ZP>},
-                { 0x94, 4, ZPX, Store<Y, ZPX>},
-                { 0x8c, 4, ABS, Store<Y, ABS>},
-            } },
-
-            { "dec", {
-                { 0xc6, 5, ZP, Inc<ZP, -1>},
-                { 0xd6, 6, ZPX, Inc<ZPX, -1>},
-                { 0xce, 6, ABS, Inc<ABS, -1>},
-                { 0xde, 7, ABSX, Inc<ABSX, -1>},
-            } },
-
-            { "inc", {
-                { 0xe6, 5, ZP, Inc<ZP, 1>},
-                { 0xf6, 6, ZPX, Inc<ZPX, 1>},
-                { 0xee, 6, ABS, Inc<ABS, 1>},
-                { 0xfe, 7, ABSX, Inc<ABSX, 1>},
-            } },
-
-            { "tax", { { 0xaa, 2, NONE, Transfer<A, X> } } },
-            { "txa", { { 0x8a, 2, NONE, Transfer<X, A> } } },
-            { "tay", { { 0xa8, 2, NONE, Transfer<A, Y> } } },
-            { "tya", { { 0x98, 2, NONE, Transfer<Y, A> } } },
-            { "txs", { { 0x9a, 2, NONE, Transfer<X, SP> } } },
-            { "tsx", { { 0xba, 2, NONE, Transfer<SP, X> } } },
-
-            { "dex", { { 0xca, 2, NONE, Inc<X, -1> } } },
-            { "inx", { { 0xe8, 2, NONE, Inc<X, 1> } } },
-            { "dey", { { 0x88, 2, NONE, Inc<Y, -1> } } },
-            { "iny", { { 0xc8, 2, NONE, Inc<Y, 1> } } },
-
-            { "pha", { { 0x48, 3, NONE, [](Machine& m) {
-                m.stack[m.sp--] = m.a;
-            } } } },
-
-            { "pla", { { 0x68, 4, NONE, [](Machine& m) {
-                m.a = m.stack[++m.sp];
-            } } } },
-
-            { "php", { { 0x08, 3, NONE, [](Machine& m) {
-                m.stack[m.sp--] = m.get_SR();
-            } } } },
-
-            { "plp", { { 0x28, 4, NONE, [](Machine& m) {
-                m.set_SR(m.stack[++m.sp]);
-            } } } },
-
-            { "bcc", { { 0x90, 2, REL, Branch<CARRY, CLEAR> }, } },
-            { "bcs", { { 0xb0, 2, REL, Branch<CARRY, SET> }, } },
-            { "bne", { { 0xd0, 2, REL, Branch<ZERO, CLEAR> }, } },
-            { "beq", { { 0xf0, 2, REL, Branch<ZERO, SET> }, } },
-            { "bpl", { { 0x10, 2, REL, Branch<SIGN, CLEAR> }, } },
-            { "bmi", { { 0x30, 2, REL, Branch<SIGN, SET> }, } },
-            { "bvc", { { 0x50, 2, REL, Branch<OVER, CLEAR> }, } },
-            { "bvs", { { 0x70, 2, REL, Branch<OVER, SET> }, } },
-
-            { "adc", {
-                { 0x69, 2, IMM, Adc<IMM, USE_BCD>},
-                { 0x65, 3, ZP, Adc<ZP, USE_BCD>},
-                { 0x75, 4, ZPX, Adc<ZPX, USE_BCD>},
-                { 0x6d, 4, ABS, Adc<ABS, USE_BCD>},
-                { 0x7d, 4, ABSX, Adc<ABSX, USE_BCD>},
-                { 0x79, 4, ABSY, Adc<ABSY, USE_BCD>},
-                { 0x61, 6, INDX, Adc<INDX, USE_BCD>},
-                { 0x71, 5, INDY, Adc<INDY, USE_BCD>},
-            } },
-
-            { "sbc", {
-                { 0xe9, 2, IMM, Sbc<IMM, USE_BCD>},
-                { 0xe5, 3, ZP, Sbc<ZP, USE_BCD>},
-                { 0xf5, 4, ZPX, Sbc<ZPX, USE_BCD>},
-                { 0xed, 4, ABS, Sbc<ABS, USE_BCD>},
-                { 0xfd, 4, ABSX, Sbc<ABSX, USE_BCD>},
-                { 0xf9, 4, ABSY, Sbc<ABSY, USE_BCD>},
-                { 0xe1, 6, INDX, Sbc<INDX, USE_BCD>},
-                { 0xf1, 5, INDY, Sbc<INDY, USE_BCD>},
-            } },
-
-            { "cmp", {
-                { 0xc9, 2, IMM, Cmp<A, IMM>},
-                { 0xc5, 3, ZP, Cmp<A, ZP>},
-                { 0xd5, 4, ZPX, Cmp<A, ZPX>},
-                { 0xcd, 4, ABS, Cmp<A, ABS>},
-                { 0xdd, 4, ABSX, Cmp<A, ABSX>},
-                { 0xd9, 4, ABSY, Cmp<A, ABSY>},
-                { 0xc1, 6, INDX, Cmp<A, INDX>},
-                { 0xd1, 5, INDY, Cmp<A, INDY>},
-            } },
-
-            { "cpx", {
-                { 0xe0, 2, IMM, Cmp<X, IMM>},
-                { 0xe4, 3, ZP, Cmp<X, ZP>},
-                { 0xec, 4, ABS, Cmp<X, ABS>},
-            } },
-
-            { "cpy", {
-                { 0xc0, 2, IMM, Cmp<Y, IMM>},
-                { 0xc4, 3, ZP, Cmp<Y, ZP>},
-                { 0xcc, 4, ABS, Cmp<Y, ABS>},
-            } },
-
-            { "and", {
-                { 0x29, 2, IMM, And<IMM>},
-                { 0x25, 3, ZP, And<ZP>},
-                { 0x35, 4, ZPX, And<ZPX>},
-                { 0x2d, 4, ABS, And<ABS>},
-                { 0x3d, 4, ABSX, And<ABSX>},
-                { 0x39, 4, ABSY, And<ABSY>},
-                { 0x21, 6, INDX, And<INDX>},
-                { 0x31, 5, INDY, And<INDY>},
-            } },
-
-            { "eor", {
-                { 0x49, 2, IMM, Eor<IMM>},
-                { 0x45, 3, ZP, Eor<ZP>},
-                { 0x55, 4, ZPX, Eor<ZPX>},
-                { 0x4d, 4, ABS, Eor<ABS>},
-                { 0x5d, 4, ABSX, Eor<ABSX>},
-                { 0x59, 4, ABSY, Eor<ABSY>},
-                { 0x41, 6, INDX, Eor<INDX>},
-                { 0x51, 5, INDY, Eor<INDY>},
-            } },
-
-            { "ora", {
-                { 0x09, 2, IMM, Ora<IMM>},
-                { 0x05, 3, ZP, Ora<ZP>},
-                { 0x15, 4, ZPX, Ora<ZPX>},
-                { 0x0d, 4, ABS, Ora<ABS>},
-                { 0x1d, 4, ABSX, Ora<ABSX>},
-                { 0x19, 4, ABSY, Ora<ABSY>},
-                { 0x01, 6, INDX, Ora<INDX>},
-                { 0x11, 5, INDY, Ora<INDY>},
-            } },
-
-            { "sec", { { 0x38, 2, NONE, Set<CARRY, true> } } },
-            { "clc", { { 0x18, 2, NONE, Set<CARRY, false> } } },
-            { "sei", { { 0x58, 2, NONE, Set<IRQ, true> } } },
-            { "cli", { { 0x78, 2, NONE, Set<IRQ, false> } } },
-            { "sed", { { 0xf8, 2, NONE, Set<DECIMAL, true> } } },
-            { "cld", { { 0xd8, 2, NONE, Set<DECIMAL, false> } } },
-            { "clv", { { 0xb8, 2, NONE, Set<OVER, false> } } },
-
-            { "lsr", {
-                { 0x4a, 2, NONE, Lsr<A>},
-                { 0x4a, 2, ACC, Lsr<A>},
-                { 0x46, 5, ZP, Lsr<ZP>},
-                { 0x56, 6, ZPX, Lsr<ZPX>},
-                { 0x4e, 6, ABS, Lsr<ABS>},
-                { 0x5e, 7, ABSX, Lsr<ABSX>},
-            } },
-
-            { "asl", {
-                { 0x0a, 2, NONE, Asl<A>},
-                { 0x0a, 2, ACC, Asl<A>},
-                { 0x06, 5, ZP, Asl<ZP>},
-                { 0x16, 6, ZPX, Asl<ZPX>},
-                { 0x0e, 6, ABS, Asl<ABS>},
-                { 0x1e, 7, ABSX, Asl<ABSX>},
-            } },
-
-            { "ror", {
-                { 0x6a, 2, NONE, Ror<A>},
-                { 0x6a, 2, ACC, Ror<A>},
-                { 0x66, 5, ZP, Ror<ZP>},
-                { 0x76, 6, ZPX, Ror<ZPX>},
-                { 0x6e, 6, ABS, Ror<ABS>},
-                { 0x7e, 7, ABSX, Ror<ABSX>},
-            } },
-
-            { "rol", {
-                { 0x2a, 2, NONE, Rol<A>},
-                { 0x2a, 2, ACC, Rol<A>},
-                { 0x26, 5, ZP, Rol<ZP>},
-                { 0x36, 6, ZPX, Rol<ZPX>},
-                { 0x2e, 6, ABS, Rol<ABS>},
-                { 0x3e, 7, ABSX, Rol<ABSX>},
-            } },
-
-            { "bit", {
-                { 0x24, 3, ZP, Bit<ZP>},
-                { 0x2c, 4, ABS, Bit<ABS>},
-            } },
-
-            { "rti", {
-                { 0x40, 6, NONE, [](Machine& m) {
-                    m.set_SR(m.stack[m.sp+1]);
-                    m.pc = (m.stack[m.sp+2] | (m.stack[m.sp+3]<<8));
-                    m.sp += 3;
-                } }
-            } },
-
-            { "brk", {
-                { 0x00, 7, NONE, [](Machine& m) {
-                    m.ReadPC();
-                    m.stack[m.sp] = m.pc >> 8;
-                    m.stack[m.sp-1] = m.pc & 0xff;
-                    m.stack[m.sp-2] = m.get_SR();
-                    m.sp -= 3;
-                    m.pc = m.Read16(m.to_adr(0xfe, 0xff));
-                } }
-            } },
-
-            { "rts", {
-                { 0x60, 6, NONE, [](Machine& m) {
-                    if constexpr (POLICY::ExitOnStackWrap) {
-                        if (m.sp == 0xff) {
-                            m.cycles = std::numeric_limits<decltype(m.cycles)>::max()-32;
-                            return;
-                        }
-                    }
-                    m.pc = (m.stack[m.sp+1] | (m.stack[m.sp+2]<<8))+1;
-                    m.sp += 2;
-                } }
-            } },
-
-            { "jmp", {
-                { 0x4c, 3, ABS, [](Machine& m) {
-                    m.pc = m.ReadPC16();
-                } },
-                { 0x6c, 5, IND, [](Machine& m) {
-                    m.pc = m.Read16(m.ReadPC16());
-                } }
-            } },
-
-            { "jsr", {
-                { 0x20, 6, ABS, [](Machine& m) {
-                    m.stack[m.sp] = (m.pc+1) >> 8;
-                    m.stack[m.sp-1] = (m.pc+1) & 0xff;
-                    m.sp -= 2;
-                    m.pc = m.ReadPC16();
-                } }
-            } },
+    // The most common sequences from profiling (`sixfive -P`) the programs
+    // in asm/ and Bench_sort, plus some typical loop idioms. Only one
+    // superinstruction can start with a given opcode.
+    static constexpr Opcode superinstructions[] = {
+        // microchess.asm
+        { 0x48, 3, NONE, op<Fused<Push<A>, Then<0xad, Load<A, ABS>>, Then<0x29, And<IMM>>>> },
+        { 0xad, 4, ABS, op<Fused<Load<A, ABS>, Then<0x29, And<IMM>>>> },
+        { 0x68, 4, NONE, op<Fused<Pull<A>, Then<0x8d, Store<A, ABS>>, Then<0x60, Rts>>> },
+        { 0xca, 2, NONE, op<Fused<Inc<X, -1>, BNE>> },
+        // bubble.asm, Bench_sort
+        { 0xb1, 5, INDY, op<Fused<Load<A, INDY>, Then<0xc8, Inc<Y, 1>>, Then<0xd1, Cmp<A, INDY>>, BCC>> },
+        // root.asm
+        { 0x26, 5, ZP, op<Fused<Rol<ZP>, Then<0x26, Rol<ZP>>>> },
+        { 0xa5, 2, ZP, op<Fused<Load<A, ZP>, Then<0xc5, Cmp<A, ZP>>, BCC>> },
+        // week.asm
+        { 0x69, 2, IMM, op<Fused<Adc<IMM>, BCC>> },
+        // Loop idioms
+        { 0x88, 2, NONE, op<Fused<Inc<Y, -1>, BNE>> },
+        { 0xc8, 2, NONE, op<Fused<Inc<Y, 1>, Then<0xc0, Cmp<Y, IMM>>, BNE>> },
+        { 0xe8, 2, NONE, op<Fused<Inc<X, 1>, Then<0xe0, Cmp<X, IMM>>, BNE>> },
+        { 0xc9, 2, IMM, op<Fused<Cmp<A, IMM>, BNE>> },
+    };
 
-        };
-        return instructionTable;
-    }
+    // All opcodes of all instructions. Shifts are listed both without an
+    // operand and with `a`.
+    template <bool USE_BCD = false>
+    static constexpr OpcodeDef instructionTable[] = {
+        { "nop", 0xea, 2, NONE, op<Nop> },
+
+        { "lda", 0xa9, 2, IMM, op<Load<A, IMM>> },
+        { "lda", 0xa5, 2, ZP, op<Load<A, ZP>> },
+        { "lda", 0xb5, 4, ZPX, op<Load<A, ZPX>> },
+        { "lda", 0xad, 4, ABS, op<Load<A, ABS>> },
+        { "lda", 0xbd, 4, ABSX, op<Load<A, ABSX>> },
+        { "lda", 0xb9, 4, ABSY, op<Load<A, ABSY>> },
+        { "lda", 0xa1, 6, INDX, op<Load<A, INDX>> },
+        { "lda", 0xb1, 5, INDY, op<Load<A, INDY>> },
+
+        { "ldx", 0xa2, 2, IMM, op<Load<X, IMM>> },
+        { "ldx", 0xa6, 3, ZP, op<Load<X, ZP>> },
+        { "ldx", 0xb6, 4, ZPY, op<Load<X, ZPY>> },
+        { "ldx", 0xae, 4, ABS, op<Load<X, ABS>> },
+        { "ldx", 0xbe, 4, ABSY, op<Load<X, ABSY>> },
+
+        { "ldy", 0xa0, 2, IMM, op<Load<Y, IMM>> },
+        { "ldy", 0xa4, 3, ZP, op<Load<Y, ZP>> },
+        { "ldy", 0xb4, 4, ZPX, op<Load<Y, ZPX>> },
+        { "ldy", 0xac, 4, ABS, op<Load<Y, ABS>> },
+        { "ldy", 0xbc, 4, ABSX, op<Load<Y, ABSX>> },
+
+        { "sta", 0x85, 3, ZP, op<Store<A, ZP>> },
+        { "sta", 0x95, 4, ZPX, op<Store<A, ZPX>> },
+        { "sta", 0x8d, 4, ABS, op<Store<A, ABS>> },
+        { "sta", 0x9d, 4, ABSX, op<Store<A, ABSX>> },
+        { "sta", 0x99, 4, ABSY, op<Store<A, ABSY>> },
+        { "sta", 0x81, 6, INDX, op<Store<A, INDX>> },
+        { "sta", 0x91, 5, INDY, op<Store<A, INDY>> },
+
+        { "stx", 0x86, 3, ZP, op<Store<X, ZP>> },
+        { "stx", 0x96, 4, ZPY, op<Store<X, ZPY>> },
+        { "stx", 0x8e, 4, ABS, op<Store<X, ABS>> },
+
+        { "sty", 0x84, 3, ZP, op<Store<Y, ZP>> },
+        { "sty", 0x94, 4, ZPX, op<Store<Y, ZPX>> },
+        { "sty", 0x8c, 4, ABS, op<Store<Y, ABS>> },
+
+        { "dec", 0xc6, 5, ZP, op<Inc<ZP, -1>> },
+        { "dec", 0xd6, 6, ZPX, op<Inc<ZPX, -1>> },
+        { "dec", 0xce, 6, ABS, op<Inc<ABS, -1>> },
+        { "dec", 0xde, 7, ABSX, op<Inc<ABSX, -1>> },
+
+        { "inc", 0xe6, 5, ZP, op<Inc<ZP, 1>> },
+        { "inc", 0xf6, 6, ZPX, op<Inc<ZPX, 1>> },
+        { "inc", 0xee, 6, ABS, op<Inc<ABS, 1>> },
+        { "inc", 0xfe, 7, ABSX, op<Inc<ABSX, 1>> },
+
+        { "tax", 0xaa, 2, NONE, op<Transfer<A, X>> },
+        { "txa", 0x8a, 2, NONE, op<Transfer<X, A>> },
+        { "tay", 0xa8, 2, NONE, op<Transfer<A, Y>> },
+        { "tya", 0x98, 2, NONE, op<Transfer<Y, A>> },
+        { "txs", 0x9a, 2, NONE, op<Transfer<X, SP>> },
+        { "tsx", 0xba, 2, NONE, op<Transfer<SP, X>> },
+
+        { "dex", 0xca, 2, NONE, op<Inc<X, -1>> },
+        { "inx", 0xe8, 2, NONE, op<Inc<X, 1>> },
+        { "dey", 0x88, 2, NONE, op<Inc<Y, -1>> },
+        { "iny", 0xc8, 2, NONE, op<Inc<Y, 1>> },
+
+        { "pha", 0x48, 3, NONE, op<Push<A>> },
+
+        { "pla", 0x68, 4, NONE, op<Pull<A>> },
+
+        { "php", 0x08, 3, NONE, op<Push<SR>> },
+
+        { "plp", 0x28, 4, NONE, op<Pull<SR>> },
+
+        { "bcc", 0x90, 2, REL, op<Branch<CARRY, CLEAR>> },
+        { "bcs", 0xb0, 2, REL, op<Branch<CARRY, SET>> },
+        { "bne", 0xd0, 2, REL, op<Branch<ZERO, CLEAR>> },
+        { "beq", 0xf0, 2, REL, op<Branch<ZERO, SET>> },
+        { "bpl", 0x10, 2, REL, op<Branch<SIGN, CLEAR>> },
+        { "bmi", 0x30, 2, REL, op<Branch<SIGN, SET>> },
+        { "bvc", 0x50, 2, REL, op<Branch<OVER, CLEAR>> },
+        { "bvs", 0x70, 2, REL, op<Branch<OVER, SET>> },
+
+        { "adc", 0x69, 2, IMM, op<Adc<IMM, USE_BCD>> },
+        { "adc", 0x65, 3, ZP, op<Adc<ZP, USE_BCD>> },
+        { "adc", 0x75, 4, ZPX, op<Adc<ZPX, USE_BCD>> },
+        { "adc", 0x6d, 4, ABS, op<Adc<ABS, USE_BCD>> },
+        { "adc", 0x7d, 4, ABSX, op<Adc<ABSX, USE_BCD>> },
+        { "adc", 0x79, 4, ABSY, op<Adc<ABSY, USE_BCD>> },
+        { "adc", 0x61, 6, INDX, op<Adc<INDX, USE_BCD>> },
+        { "adc", 0x71, 5, INDY, op<Adc<INDY, USE_BCD>> },
+
+        { "sbc", 0xe9, 2, IMM, op<Sbc<IMM, USE_BCD>> },
+        { "sbc", 0xe5, 3, ZP, op<Sbc<ZP, USE_BCD>> },
+        { "sbc", 0xf5, 4, ZPX, op<Sbc<ZPX, USE_BCD>> },
+        { "sbc", 0xed, 4, ABS, op<Sbc<ABS, USE_BCD>> },
+        { "sbc", 0xfd, 4, ABSX, op<Sbc<ABSX, USE_BCD>> },
+        { "sbc", 0xf9, 4, ABSY, op<Sbc<ABSY, USE_BCD>> },
+        { "sbc", 0xe1, 6, INDX, op<Sbc<INDX, USE_BCD>> },
+        { "sbc", 0xf1, 5, INDY, op<Sbc<INDY, USE_BCD>> },
+
+        { "cmp", 0xc9, 2, IMM, op<Cmp<A, IMM>> },
+        { "cmp", 0xc5, 3, ZP, op<Cmp<A, ZP>> },
+        { "cmp", 0xd5, 4, ZPX, op<Cmp<A, ZPX>> },
+        { "cmp", 0xcd, 4, ABS, op<Cmp<A, ABS>> },
+        { "cmp", 0xdd, 4, ABSX, op<Cmp<A, ABSX>> },
+        { "cmp", 0xd9, 4, ABSY, op<Cmp<A, ABSY>> },
+        { "cmp", 0xc1, 6, INDX, op<Cmp<A, INDX>> },
+        { "cmp", 0xd1, 5, INDY, op<Cmp<A, INDY>> },
+
+        { "cpx", 0xe0, 2, IMM, op<Cmp<X, IMM>> },
+        { "cpx", 0xe4, 3, ZP, op<Cmp<X, ZP>> },
+        { "cpx", 0xec, 4, ABS, op<Cmp<X, ABS>> },
+
+        { "cpy", 0xc0, 2, IMM, op<Cmp<Y, IMM>> },
+        { "cpy", 0xc4, 3, ZP, op<Cmp<Y, ZP>> },
+        { "cpy", 0xcc, 4, ABS, op<Cmp<Y, ABS>> },
+
+        { "and", 0x29, 2, IMM, op<And<IMM>> },
+        { "and", 0x25, 3, ZP, op<And<ZP>> },
+        { "and", 0x35, 4, ZPX, op<And<ZPX>> },
+        { "and", 0x2d, 4, ABS, op<And<ABS>> },
+        { "and", 0x3d, 4, ABSX, op<And<ABSX>> },
+        { "and", 0x39, 4, ABSY, op<And<ABSY>> },
+        { "and", 0x21, 6, INDX, op<And<INDX>> },
+        { "and", 0x31, 5, INDY, op<And<INDY>> },
+
+        { "eor", 0x49, 2, IMM, op<Eor<IMM>> },
+        { "eor", 0x45, 3, ZP, op<Eor<ZP>> },
+        { "eor", 0x55, 4, ZPX, op<Eor<ZPX>> },
+        { "eor", 0x4d, 4, ABS, op<Eor<ABS>> },
+        { "eor", 0x5d, 4, ABSX, op<Eor<ABSX>> },
+        { "eor", 0x59, 4, ABSY, op<Eor<ABSY>> },
+        { "eor", 0x41, 6, INDX, op<Eor<INDX>> },
+        { "eor", 0x51, 5, INDY, op<Eor<INDY>> },
+
+        { "ora", 0x09, 2, IMM, op<Ora<IMM>> },
+        { "ora", 0x05, 3, ZP, op<Ora<ZP>> },
+        { "ora", 0x15, 4, ZPX, op<Ora<ZPX>> },
+        { "ora", 0x0d, 4, ABS, op<Ora<ABS>> },
+        { "ora", 0x1d, 4, ABSX, op<Ora<ABSX>> },
+        { "ora", 0x19, 4, ABSY, op<Ora<ABSY>> },
+        { "ora", 0x01, 6, INDX, op<Ora<INDX>> },
+        { "ora", 0x11, 5, INDY, op<Ora<INDY>> },
+
+        { "sec", 0x38, 2, NONE, op<Set<CARRY, true>> },
+        { "clc", 0x18, 2, NONE, op<Set<CARRY, false>> },
+        { "cli", 0x58, 2, NONE, op<Set<IRQ, false>> },
+        { "sei", 0x78, 2, NONE, op<Set<IRQ, true>> },
+        { "sed", 0xf8, 2, NONE, op<Set<DECIMAL, true>> },
+        { "cld", 0xd8, 2, NONE, op<Set<DECIMAL, false>> },
+        { "clv", 0xb8, 2, NONE, op<Set<OVER, false>> },
+
+        { "lsr", 0x4a, 2, NONE, op<Lsr<A>> },
+        { "lsr", 0x4a, 2, ACC, op<Lsr<A>> },
+        { "lsr", 0x46, 5, ZP, op<Lsr<ZP>> },
+        { "lsr", 0x56, 6, ZPX, op<Lsr<ZPX>> },
+        { "lsr", 0x4e, 6, ABS, op<Lsr<ABS>> },
+        { "lsr", 0x5e, 7, ABSX, op<Lsr<ABSX>> },
+
+        { "asl", 0x0a, 2, NONE, op<Asl<A>> },
+        { "asl", 0x0a, 2, ACC, op<Asl<A>> },
+        { "asl", 0x06, 5, ZP, op<Asl<ZP>> },
+        { "asl", 0x16, 6, ZPX, op<Asl<ZPX>> },
+        { "asl", 0x0e, 6, ABS, op<Asl<ABS>> },
+        { "asl", 0x1e, 7, ABSX, op<Asl<ABSX>> },
+
+        { "ror", 0x6a, 2, NONE, op<Ror<A>> },
+        { "ror", 0x6a, 2, ACC, op<Ror<A>> },
+        { "ror", 0x66, 5, ZP, op<Ror<ZP>> },
+        { "ror", 0x76, 6, ZPX, op<Ror<ZPX>> },
+        { "ror", 0x6e, 6, ABS, op<Ror<ABS>> },
+        { "ror", 0x7e, 7, ABSX, op<Ror<ABSX>> },
+
+        { "rol", 0x2a, 2, NONE, op<Rol<A>> },
+        { "rol", 0x2a, 2, ACC, op<Rol<A>> },
+        { "rol", 0x26, 5, ZP, op<Rol<ZP>> },
+        { "rol", 0x36, 6, ZPX, op<Rol<ZPX>> },
+        { "rol", 0x2e, 6, ABS, op<Rol<ABS>> },
+        { "rol", 0x3e, 7, ABSX, op<Rol<ABSX>> },
+
+        { "bit", 0x24, 3, ZP, op<Bit<ZP>> },
+        { "bit", 0x2c, 4, ABS, op<Bit<ABS>> },
+
+        { "rti", 0x40, 6, NONE, op<Rti> },
+
+        { "brk", 0x00, 7, NONE, op<Brk> },
+
+        { "rts", 0x60, 6, NONE, op<Rts> },
+
+        { "jmp", 0x4c, 3, ABS, op<Jmp<ABS>> },
+        { "jmp", 0x6c, 5, IND, op<Jmp<IND>> },
+
+        { "jsr", 0x20, 6, ABS, op<Jsr> },
+    };
 };
+
+template <typename POLICY>
+constexpr std::array<typename Machine<POLICY>::Opcode, 256>
+    Machine<POLICY>::jumpTable_normal = Machine::makeJumpTable<false>();
+template <typename POLICY>
+constexpr std::array<typename Machine<POLICY>::Opcode, 256>
+    Machine<POLICY>::jumpTable_bcd = Machine::makeJumpTable<true>();
+template <typename POLICY>
+constexpr std::array<typename Machine<POLICY>::OpcodeInfo, 256>
+    Machine<POLICY>::opcodeInfo = Machine::makeOpcodeInfo();
+
 } // namespace sixfive
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "memory.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace sixfive {
+
+// A host file that a 6502 program can seek in, and read and write by DMA.
+// The file is mapped into memory, so a transfer is one `memcpy()` between
+// the file and guest memory, and files larger than 64K can be streamed
+// through a small window.
+//
+// Registers (repeated every 16 bytes)
+//   0     Write 1 to read, 2 to write `length` bytes at `position` from or
+//         to guest memory at `adress`. Reads status; Bit 7 is set if the
+//         last read reached the end of the file, bit 6 if it failed.
+//   1-4   position in the file, moved on by each transfer
+//   5-6   adress in guest memory
+//   7-8   length (0 means 64K). Set to the bytes moved by a transfer.
+//   9-12  size of the file (read only)
+class HostFile
+{
+public:
+    enum Command
+    {
+        READ = 1,
+        WRITE = 2
+    };
+
+    explicit HostFile(const std::string& fileName, bool writable = false)
+        : writable(writable)
+    {
+#ifdef SIXFIVE_MMAP
+        fd = ::open(fileName.c_str(),
+                    (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+        if (fd < 0) throw std::runtime_error("Can not open " + fileName);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !mapTo(st.st_size)) {
+            ::close(fd);
+            throw std::runtime_error("Can not map " + fileName);
+        }
+#else
+        throw std::runtime_error("Can not map " + fileName);
+#endif
+    }
+    ~HostFile()
+    {
+#ifdef SIXFIVE_MMAP
+        if (mem) munmap(mem, mapped);
+        if (writable) (void)ftruncate(fd, len);
+        ::close(fd);
+#endif
+    }
+    HostFile(const HostFile&) = delete;
+    HostFile& operator=(const HostFile&) = delete;
+
+    size_t size() const { return len; }
+    const uint8_t* data() const { return mem; }
+
+    // Map the registers to `len` bytes from `start`
+    template <typename MACHINE>
+    static void map(MACHINE& m, uint16_t start, unsigned len = 16)
+    {
+        m.mapIO(
+            start, len,
+            [](MACHINE& m, uint16_t adr) -> uint8_t {
+                return m.policy().hostFile.read(adr);
+            },
+            [](MACHINE& m, uint16_t adr, uint8_t v) {
+                m.policy().hostFile.write(m, adr, v);
+            },
+            16);
+    }
+
+    uint8_t read(unsigned adr) const
+    {
+        auto r = adr & 0xf;
+        if (r == 0) return status;
+        if (r <= 4) return position >> (r - 1) * 8;
+        if (r <= 6) return adress >> (r - 5) * 8;
+        if (r <= 8) return length >> (r - 7) * 8;
+        if (r <= 12) return (uint64_t)len >> (r - 9) * 8;
+        return 0xff;
+    }
+
+    template <typename MACHINE> void write(MACHINE& m, unsigned adr, uint8_t v)
+    {
+        auto set = [&](auto& reg, unsigned shift) {
+            reg = (reg & ~(0xffull << shift)) | ((uint64_t)v << shift);
+        };
+        auto r = adr & 0xf;
+        if (r == 0)
+            transfer(m, v);
+        else if (r <= 4)
+            set(position, (r - 1) * 8);
+        else if (r <= 6)
+            set(adress, (r - 5) * 8);
+        else if (r <= 8)
+            set(length, (r - 7) * 8);
+    }
+
+    template <typename MACHINE> void transfer(MACHINE& m, unsigned command)
+    {
+        size_t n = length ? length : 0x10000;
+        status = 0;
+        if (command == READ) {
+            if (position + n > len) {
+                n = position < len ? len - position : 0;
+                status = 0x80;
+            }
+            if (n) m.writeMem(adress, mem + position, n);
+        } else if (command == WRITE) {
+            if (!writable || (position + n > len && !mapTo(position + n))) {
+                status = 0x40;
+                n = 0;
+            }
+            if (n) m.readMem(adress, mem + position, n);
+        } else
+            return;
+        position += n;
+        length = n & 0xffff;
+    }
+
+private:
+    // Map at least `size` bytes of the file, growing it as needed. The
+    // mapping grows by doubling, so that appending stays cheap, and the
+    // file is cut to `len` when closed.
+    bool mapTo(size_t size)
+    {
+#ifdef SIXFIVE_MMAP
+        if (size > mapped) {
+            auto cap = std::max(size, mapped * 2);
+            struct stat st;
+            if (fstat(fd, &st) != 0) return false;
+            if ((size_t)st.st_size < cap && ftruncate(fd, cap) != 0)
+                return false;
+            auto p =
+                mmap(nullptr, cap, PROT_READ | (writable ? PROT_WRITE : 0),
+                     MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) return false;
+            if (mem) munmap(mem, mapped);
+            mem = static_cast<uint8_t*>(p);
+            mapped = cap;
+        }
+        len = std::max(len, size);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    int fd = -1;
+    uint8_t* mem = nullptr;
+    size_t len = 0;
+    size_t mapped = 0;
+    bool writable;
+
+    uint32_t position = 0;
+    uint16_t adress = 0;
+    uint16_t length = 0;
+    uint8_t status = 0;
+};
+
+} // namespace sixfive
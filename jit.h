@@ -0,0 +1,437 @@
+#pragma once
+
+#include "emulator.h"
+
+#include <sys/mman.h>
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// Compiled code is x86-64, and calls the opcode functions with the System V
+// calling convention
+#if defined(__x86_64__) && !defined(_WIN32)
+#define SIXFIVE_JIT 1
+#else
+#define SIXFIVE_JIT 0
+#endif
+
+namespace sixfive {
+
+// Executable memory that x86-64 code is emitted into. It is never writable
+// and executable at the same time; Code is emitted between `writable()`
+// and `executable()`.
+class CodeArena
+{
+public:
+    explicit CodeArena(size_t size) { map(size); }
+    ~CodeArena()
+    {
+        if (start) munmap(start, size);
+    }
+
+    // Replace the arena with an empty, writable one of `newSize` bytes
+    void resize(size_t newSize)
+    {
+        if (start) munmap(start, size);
+        map(newSize);
+    }
+    CodeArena(const CodeArena&) = delete;
+    CodeArena& operator=(const CodeArena&) = delete;
+
+    bool ok() const { return start != nullptr && !failed; }
+
+    void writable() { protect(PROT_READ | PROT_WRITE); }
+    void executable() { protect(PROT_READ | PROT_EXEC); }
+    uint8_t* pos() const { return ptr; }
+    size_t left() const { return start + size - ptr; }
+    void reset(uint8_t* p) { ptr = p; }
+
+    void byte(unsigned b) { *ptr++ = b; }
+    void bytes(std::initializer_list<uint8_t> bl)
+    {
+        for (auto b : bl)
+            *ptr++ = b;
+    }
+    void u32(uint32_t v)
+    {
+        memcpy(ptr, &v, 4);
+        ptr += 4;
+    }
+    void u64(uint64_t v)
+    {
+        memcpy(ptr, &v, 8);
+        ptr += 8;
+    }
+    // Emit a 32-bit relative jump target, to be resolved by `link()`
+    uint8_t* rel32(const uint8_t* target)
+    {
+        auto* at = ptr;
+        link(at, target);
+        ptr += 4;
+        return at;
+    }
+    static void link(uint8_t* at, const uint8_t* target)
+    {
+        int32_t rel = target - (at + 4);
+        memcpy(at, &rel, 4);
+    }
+
+    size_t capacity() const { return size; }
+
+private:
+    void map(size_t newSize)
+    {
+        size = newSize;
+        auto* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        start = p == MAP_FAILED ? nullptr : static_cast<uint8_t*>(p);
+        ptr = start;
+        failed = false;
+    }
+
+    void protect(int prot)
+    {
+        if (ok() && mprotect(start, size, prot) != 0) failed = true;
+    }
+
+    size_t size;
+    uint8_t* start;
+    uint8_t* ptr;
+    // Could not be made executable or writable again
+    bool failed = false;
+};
+
+// Compiles hot, straight line blocks of 6502 code into x86-64 code that
+// calls the opcode functions of the machine one after another, without
+// going through the dispatch loop. It is call-threaded; The opcodes
+// themselves are not translated. Blocks end at branches, jumps,
+// subroutine calls and returns (and anything that can change the decimal
+// flag), and blocks with known targets are chained together.
+//
+// Enabled by setting `Dispatch = JIT` in the policy. Cycles are exact
+// at every block exit, but `eachOp` is only called between blocks, and
+// not at all while running chained blocks.
+//
+// Writes to adresses covered by a block flushes all compiled code, and
+// blocks that has been overwritten are never compiled again.
+template <typename MACHINE> struct Jit
+{
+    static_assert(SIXFIVE_JIT, "JIT dispatch needs x86-64 (System V)");
+
+    using Machine = MACHINE;
+
+    // Block entries before a block is compiled
+    static constexpr uint8_t HotCount = 16;
+    static constexpr uint8_t NeverCompile = 0xff;
+    static constexpr int MaxBlockOpcodes = 64;
+    // The arena starts small, and doubles when full until it reaches
+    // `MaxArenaSize`. After that, all code is flushed when it is full.
+    static constexpr size_t ArenaSize = 64 * 1024;
+    static constexpr size_t MaxArenaSize = 4 * 1024 * 1024;
+    // Leave room for one full block when checking if the arena is full
+    static constexpr size_t MaxBlockSize = MaxBlockOpcodes * 64 + 256;
+
+    explicit Jit(Machine& m) : arena(ArenaSize)
+    {
+        auto base = reinterpret_cast<const char*>(&m);
+        pcOffset = reinterpret_cast<const char*>(&m.pc) - base;
+        cyclesOffset = reinterpret_cast<const char*>(&m.cycles) - base;
+        limitOffset = reinterpret_cast<const char*>(&m.cycleLimit) - base;
+        dirtyOffset = reinterpret_cast<const char*>(&m.codeDirty) - base;
+
+        for (unsigned code = 0; code < 256; code++) {
+            const auto& info = Machine::opcodeInfo[code];
+            if (!info.name) continue;
+            bool ends = info.mode == REL;
+            for (auto* name : {"jmp", "jsr", "rts", "rti", "brk", "sed",
+                               "cld", "cli", "plp"})
+                if (strcmp(info.name, name) == 0) ends = true;
+            valid[code] = true;
+            endsBlock[code] = ends;
+        }
+        hits.resize(0x10000);
+        owner.resize(0x10000);
+        for (auto& b : blocks)
+            b.resize(0x10000);
+        newArena(m);
+    }
+
+    void run(Machine& m, uint32_t toCycles)
+    {
+        auto& p = m.policy();
+        m.cycleLimit = toCycles;
+        while (m.cycles < m.cycleLimit) {
+            if (Machine::Policy::eachOp(p)) break;
+            if (m.codeDirty) flush(m);
+            auto pc = m.pc;
+            if (pc > 0xffff) {
+                interpret(m);
+                continue;
+            }
+            auto& code = blocks[decimal(m)][pc];
+            if (code == nullptr && hits[pc] != NeverCompile) {
+                if (hits[pc] < HotCount)
+                    hits[pc]++;
+                else
+                    compile(m, pc);
+            }
+            if (code != nullptr && arena.ok())
+                enter(&m, code);
+            else
+                interpret(m);
+        }
+    }
+
+    // Called when an adress in a page with compiled code is written to
+    void written(Machine& m, unsigned adr)
+    {
+        auto start = owner[adr & 0xffff];
+        if (start >= 0) {
+            hits[start] = NeverCompile;
+            m.codeDirty = true;
+        }
+    }
+
+private:
+    CodeArena arena;
+    // Entry and exit trampolines live first in the arena
+    void (*enter)(Machine*, uint8_t*) = nullptr;
+    uint8_t* exitCode = nullptr;
+    uint8_t* arenaStart = nullptr;
+
+    int32_t pcOffset;
+    int32_t cyclesOffset;
+    int32_t limitOffset;
+    int32_t dirtyOffset;
+
+    std::array<bool, 256> valid{};
+    std::array<bool, 256> endsBlock{};
+
+    std::vector<uint8_t> hits;
+    // Start of the block covering each adress, or -1
+    std::vector<int32_t> owner;
+    // Compiled blocks per start adress, for normal and decimal mode
+    std::array<std::vector<uint8_t*>, 2> blocks;
+
+    // Block exits waiting for a block to be compiled at a given adress
+    struct Link
+    {
+        uint8_t* at;
+        int dec;
+    };
+    std::unordered_map<unsigned, std::vector<Link>> links;
+
+    static int decimal(const Machine& m)
+    {
+        return m.jumpTable == &Machine::jumpTable_bcd[0] ? 1 : 0;
+    }
+
+    // Run opcodes until we leave the current block
+    void interpret(Machine& m)
+    {
+        while (true) {
+            auto code = m.ReadPC();
+            auto& op = m.jumpTable[code];
+            op.op(m);
+            m.cycles += op.cycles;
+            if (endsBlock[code] || m.cycles >= m.cycleLimit) break;
+        }
+    }
+
+    void flush(Machine& m)
+    {
+        m.codeDirty = false;
+        m.decodedPages.fill(0);
+        std::fill(owner.begin(), owner.end(), -1);
+        for (auto& b : blocks)
+            std::fill(b.begin(), b.end(), nullptr);
+        links.clear();
+        if (arena.ok()) arena.reset(arenaStart);
+    }
+
+    // Set up an empty arena
+    void newArena(Machine& m)
+    {
+        if (arena.ok()) {
+            emitTrampolines();
+            arena.executable();
+        }
+        flush(m);
+    }
+
+    void emitTrampolines()
+    {
+        enter = reinterpret_cast<decltype(enter)>(arena.pos());
+        arena.byte(0x53);                    // push rbx
+        arena.bytes({0x48, 0x89, 0xfb});     // mov rbx, rdi
+        arena.bytes({0xff, 0xe6});           // jmp rsi
+        exitCode = arena.pos();
+        arena.byte(0x5b);                    // pop rbx
+        arena.byte(0xc3);                    // ret
+        arenaStart = arena.pos();
+    }
+
+    // Instructions below all use rbx (pointing to the machine) as base
+
+    void addCycles(unsigned n)
+    {
+        arena.bytes({0x83, 0x83}); // add dword [rbx+cycles], n
+        arena.u32(cyclesOffset);
+        arena.byte(n);
+    }
+
+    void setPC(unsigned pc)
+    {
+        arena.bytes({0xc7, 0x83}); // mov dword [rbx+pc], pc
+        arena.u32(pcOffset);
+        arena.u32(pc);
+    }
+
+    void callOp(typename Machine::OpFunc op)
+    {
+        arena.bytes({0x48, 0x89, 0xdf}); // mov rdi, rbx
+        arena.bytes({0x48, 0xb8});       // mov rax, op
+        arena.u64(reinterpret_cast<uint64_t>(op));
+        arena.bytes({0xff, 0xd0});       // call rax
+    }
+
+    // Leave the block if code has been overwritten
+    void checkDirty()
+    {
+        arena.bytes({0x80, 0xbb}); // cmp byte [rbx+dirty], 0
+        arena.u32(dirtyOffset);
+        arena.byte(0);
+        arena.bytes({0x0f, 0x85}); // jne exit
+        arena.rel32(exitCode);
+    }
+
+    // Leave the block if an IO callback has stopped the machine or
+    // scheduled an event
+    void checkLimit()
+    {
+        arena.bytes({0x8b, 0x8b}); // mov ecx, [rbx+cycles]
+        arena.u32(cyclesOffset);
+        arena.bytes({0x3b, 0x8b}); // cmp ecx, [rbx+limit]
+        arena.u32(limitOffset);
+        arena.bytes({0x0f, 0x83}); // jae exit
+        arena.rel32(exitCode);
+    }
+
+    // Opcodes that access memory can reach a callback, unless all access
+    // is direct
+    static constexpr bool mayCallBack(AdressingMode mode)
+    {
+        using P = typename Machine::Policy;
+        if (P::Read_AccessMode == DIRECT && P::Write_AccessMode == DIRECT)
+            return false;
+        return mode != NONE && mode != ACC && mode != IMM && mode != REL;
+    }
+
+    // Continue with the block at `target` if PC matches and we have
+    // cycles left. Links to the exit until that block is compiled.
+    void chain(unsigned target, int dec)
+    {
+        arena.byte(0x3d);          // cmp eax, target
+        arena.u32(target);
+        arena.bytes({0x0f, 0x85}); // jne next
+        auto* next = arena.rel32(arena.pos());
+        checkLimit();
+        arena.byte(0xe9);          // jmp block
+        auto* code = blocks[dec][target];
+        auto* at = arena.rel32(code ? code : exitCode);
+        if (!code) links[target].push_back({at, dec});
+        CodeArena::link(next, arena.pos());
+    }
+
+    void compile(Machine& m, unsigned start)
+    {
+        if (!arena.ok()) return;
+        if (arena.left() < MaxBlockSize) {
+            if (arena.capacity() < MaxArenaSize) {
+                arena.resize(arena.capacity() * 2);
+                newArena(m);
+                if (!arena.ok()) return;
+            } else
+                flush(m);
+        }
+        // Blocks waiting for this one are patched as well
+        arena.writable();
+        emit(m, start);
+        arena.executable();
+    }
+
+    void emit(Machine& m, unsigned start)
+    {
+        auto dec = decimal(m);
+        auto* code = arena.pos();
+
+        unsigned pc = start;
+        int count = 0;
+        uint8_t last = 0;
+        while (count < MaxBlockOpcodes && pc <= 0xffff) {
+            last = m.template Read<Machine::Policy::PC_AccessMode>(pc);
+            if (!valid[last]) break;
+            const auto& op = m.jumpTable[last];
+            setPC(pc + 1);
+            callOp(op.op);
+            addCycles(op.cycles);
+            for (unsigned a = pc; a < pc + opSize(op.mode); a++) {
+                owner[a & 0xffff] = start;
+                m.decodedPages[(a >> 8) & 0xff] = 1;
+            }
+            pc += opSize(op.mode);
+            count++;
+            if (endsBlock[last]) break;
+            if (mayCallBack(op.mode)) checkLimit();
+            checkDirty();
+        }
+        if (count == 0) {
+            arena.reset(code);
+            hits[start] = NeverCompile;
+            return;
+        }
+
+        // Where can we go from here?
+        unsigned targets[2];
+        int n = 0;
+        if (!endsBlock[last]) {
+            targets[n++] = pc;
+        } else {
+            const auto& op = m.jumpTable[last];
+            auto arg = [&](unsigned a) {
+                return m.template Read<Machine::Policy::PC_AccessMode>(a);
+            };
+            if (op.mode == REL) {
+                targets[n++] = pc;
+                targets[n++] = (pc + static_cast<int8_t>(arg(pc - 1))) & 0xffff;
+            } else if (last == 0x4c || last == 0x20) { // jmp abs / jsr
+                targets[n++] = arg(pc - 2) | (arg(pc - 1) << 8);
+            }
+        }
+        if (n > 0) {
+            arena.bytes({0x8b, 0x83}); // mov eax, [rbx+pc]
+            arena.u32(pcOffset);
+            for (int i = 0; i < n; i++)
+                chain(targets[i], dec);
+        }
+        arena.byte(0xe9); // jmp exit
+        arena.rel32(exitCode);
+
+        blocks[dec][start] = code;
+        auto it = links.find(start);
+        if (it != links.end()) {
+            auto& waiting = it->second;
+            for (auto l = waiting.begin(); l != waiting.end();) {
+                if (l->dec == dec) {
+                    CodeArena::link(l->at, code);
+                    l = waiting.erase(l);
+                } else
+                    l++;
+            }
+        }
+    }
+};
+
+} // namespace sixfive
@@ -1,6 +1,8 @@
 #include "compile.h"
 #include "emulator.h"
 #include "monitor.h"
+#include "pipe.h"
+#include "runner.h"
 
 #include "CLI11.hpp"
 
@@ -9,9 +11,12 @@
 
 #include <benchmark/benchmark.h>
 
+#include <chrono>
+#include <fstream>
 #include <functional>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 
 #include <bbsutils/console.h>
 #include <bbsutils/editor.h>
@@ -51,36 +56,42 @@ struct DebugPolicy : public sixfive::DefaultPolicy
     {
         return 0;
     }
+    // Registers and RAM after the previous opcode, for `checkEffect()`
+    std::tuple<unsigned, unsigned, unsigned, unsigned, unsigned, unsigned>
+        lastRegs;
+    std::vector<uint8_t> lastRam;
+
     void checkEffect()
     {
-        static sixfive::Machine<DebugPolicy> om;
 		auto& m = machine;
-        if (om.regPC() != 0) {
-            // if(om.pc != m.pc)
-            print("%04x : ", (unsigned)om.regPC());
+        if (!lastRam.empty()) {
+            const auto [a, x, y, sr, sp, pc] = lastRegs;
+            print("%04x : ", pc);
             print("[ ");
-            if (om.regA() != m.regA()) print("A:%02x ", m.regA());
-            if (om.regX() != m.regX()) print("X:%02x ", m.regX());
-            if (om.regY() != m.regY()) print("Y:%02x ", m.regY());
-            if (om.regSR() != m.regSR()) print("SR:%02x ", m.regSR());
-            if (om.regSP() != m.regSP()) print("SP:%02x ", m.regSP());
+            if (a != m.regA()) print("A:%02x ", m.regA());
+            if (x != m.regX()) print("X:%02x ", m.regX());
+            if (y != m.regY()) print("Y:%02x ", m.regY());
+            if (sr != m.regSR()) print("SR:%02x ", m.regSR());
+            if (sp != m.regSP()) print("SP:%02x ", m.regSP());
             bool first = true;
             for (int i = 0; i < 65536; i++)
-                if (m.Ram(i) != om.Ram(i)) {
+                if (m.Ram(i) != lastRam[i]) {
                     if (!first) print(" # ");
                     first = false;
                     print("%04x: ", i);
-                    while (m.Ram(i) != om.Ram(i)) {
+                    while (m.Ram(i) != lastRam[i]) {
                         print("%02x ", m.Ram(i) & 0xff);
-                        om.Ram(i) = m.Ram(i);
+                        lastRam[i] = m.Ram(i);
                     }
                 }
             print("]\n");
         } else {
+            lastRam.resize(65536);
             for (int i = 0; i < 65536; i++)
-                om.Ram(i) = m.Ram(i);
+                lastRam[i] = m.Ram(i);
         }
-        om.regs() = m.regs();
+        lastRegs = {m.regA(), m.regX(), m.regY(), m.regSR(), m.regSP(),
+                    m.regPC()};
     }
 
     std::unordered_map<uint16_t, std::function<void(Machine& m)>> breaks;
@@ -90,34 +101,40 @@ struct DebugPolicy : public sixfive::DefaultPolicy
         breaks[pc] = std::move(f);
     }
 
-    inline static bool doTrace = false;
+    bool doTrace = false;
+    int lastpc = -1;
 
     static bool eachOp(DebugPolicy& dp)
     {
-        static int lastpc = -1;
-        if (doTrace) dp.checkEffect();
+        if (dp.doTrace) dp.checkEffect();
 		auto& m = dp.machine;
-        if (m.regPC() == lastpc) {
+        if (m.regPC() == dp.lastpc) {
             dp.print("STALL\n");
             return true;
         }
-        lastpc = m.regPC();
+        dp.lastpc = m.regPC();
         return false;
     }
 
 };
 
 
+template <bool LAZY, int DISPATCH = sixfive::TABLE>
 struct CheckPolicy : public sixfive::DefaultPolicy
 {
 	sixfive::Machine<CheckPolicy>& machine;
 
 	CheckPolicy(sixfive::Machine<CheckPolicy>& m) : machine(m) {}
 
+    static constexpr bool LazyFlags = LAZY;
+    static constexpr int Dispatch = DISPATCH;
+
+    int lastpc = -1;
+
     static bool eachOp(CheckPolicy& dp)
     {
 		auto& m = dp.machine;
-        static int lastpc = -1;
+        auto& lastpc = dp.lastpc;
         if (m.regPC() == lastpc) {
             const auto [a, x, y, sr, sp, pc] = m.regs();
             printf("STALL @ %04x A %02x X %02x Y %02x SR %02x SP %02x\n",
@@ -132,8 +149,6 @@ struct CheckPolicy : public sixfive::DefaultPolicy
         lastpc = m.regPC();
         return false;
     }
-
-    static inline bool doTrace = false;
 };
 
 struct IOPolicy : public sixfive::DefaultPolicy
@@ -148,8 +163,147 @@ struct IOPolicy : public sixfive::DefaultPolicy
     }
 };
 
+template <bool FUSED> struct ProfilePolicy : public sixfive::DefaultPolicy
+{
+    using Machine = sixfive::Machine<ProfilePolicy>;
+
+    static constexpr bool ProfileOpcodes = true;
+    static constexpr bool Superinstructions = FUSED;
+
+    // Requirements in the source are not checked when profiling
+    void set_break(uint16_t pc, std::function<void(Machine& m)> f) {}
+};
+
+template <bool FUSED>
+sixfive::OpcodeProfile profileProgram(const std::string& asmFile)
+{
+    sixfive::Machine<ProfilePolicy<FUSED>> m;
+    if (!sixfive::compile(asmFile, m)) return {};
+    m.setPC(0x1000);
+    m.run(10000000);
+    return m.opcodeProfile();
+}
+
+// Print the most common opcode sequences in a program, and how many
+// dispatches the current superinstructions saves
+void profile(const std::string& asmFile)
+{
+    const auto& info = sixfive::Machine<>::opcodeInfo;
+    auto plain = profileProgram<false>(asmFile);
+    auto fused = profileProgram<true>(asmFile);
+
+    printf("Most common sequences:\n");
+    for (const auto& s : plain.top(10)) {
+        printf("%10llu ", (unsigned long long)s.count);
+        for (auto code : s.codes)
+            printf(" %s ($%02x)", info[code].name ? info[code].name : "???",
+                   code);
+        printf("\n");
+    }
+    printf("Opcodes: %llu Dispatches with superinstructions: %llu "
+           "(%llu saved)\n",
+           (unsigned long long)plain.dispatches,
+           (unsigned long long)fused.dispatches,
+           (unsigned long long)fused.fused);
+}
+
 namespace sixfive {
 void checkAllCode(bool dis);
+bool runTests();
+}
+
+// Returns the cycles used
+template <typename POLICY> uint32_t fullTest(const char* what)
+{
+    using namespace std::chrono;
+    printf("Running full 6502 test (%s)...\n", what);
+    utils::File f{"6502test.bin"};
+    auto data = f.readAll();
+    data[0x3b91] = 0x60;
+    sixfive::Machine<POLICY> m;
+    m.writeRam(0, &data[0], 0x10000);
+    m.setPC(0x1000);
+    auto start = steady_clock::now();
+    auto used = m.run(1000000000);
+    auto ms = duration_cast<milliseconds>(steady_clock::now() - start);
+    printf("Done in %d ms, %u cycles.\n", (int)ms.count(), used);
+    return used;
+}
+
+template <bool LAZY> bool fullTests()
+{
+    auto table = fullTest<CheckPolicy<LAZY>>("table");
+    auto threaded =
+        fullTest<CheckPolicy<LAZY, sixfive::THREADED>>("threaded");
+    if (threaded == table) return true;
+    printf("Cycles differ when threaded\n");
+    return false;
+}
+
+struct JobPolicy : public sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = sixfive::DIRECT;
+    static constexpr int Read_AccessMode = sixfive::DIRECT;
+    static constexpr int Write_AccessMode = sixfive::DIRECT;
+    // Machines are restored between jobs
+    static constexpr bool Snapshots = true;
+};
+
+// Run all jobs in a manifest and write the results to `outFile`
+int runJobs(const std::string& manifest, const std::string& outFile,
+            unsigned threads, int timeoutMs)
+{
+    using namespace std::chrono;
+    std::vector<sixfive::Job> jobs;
+    try {
+        jobs = sixfive::readManifest(manifest);
+    } catch (std::exception& e) {
+        printf("%s: %s\n", manifest.c_str(), e.what());
+        return -1;
+    }
+    sixfive::JobRunner<JobPolicy> runner(threads, milliseconds(timeoutMs));
+    auto start = steady_clock::now();
+    auto results = runner.run(jobs);
+    auto ms = duration_cast<milliseconds>(steady_clock::now() - start);
+
+    std::ofstream out(outFile);
+    sixfive::writeResults(out, jobs, results);
+
+    uint64_t cycles = 0;
+    int timeouts = 0;
+    for (const auto& r : results) {
+        cycles += r.cycles;
+        timeouts += r.status == sixfive::JobResult::TIMEOUT;
+    }
+    printf("%d jobs (%d timed out), %llu cycles on %u threads in %d ms\n",
+           (int)jobs.size(), timeouts, (unsigned long long)cycles,
+           runner.threadCount(), (int)ms.count());
+    return 0;
+}
+
+struct FilterPolicy : public sixfive::DefaultPolicy
+{
+    // Only the pipe registers need callbacks
+    static constexpr int Read_AccessMode = sixfive::HYBRID;
+    static constexpr int Write_AccessMode = sixfive::HYBRID;
+
+    sixfive::Pipe pipe;
+};
+
+// Run an assembled program (loaded at $1000) until it returns, with stdin
+// and stdout at $de00 (see `Pipe`)
+int runFilter(const std::string& binFile)
+{
+    utils::File f{binFile};
+    auto data = f.readAll();
+    sixfive::Machine<FilterPolicy> m;
+    m.writeRam(0x1000, data.data(), std::min<size_t>(data.size(), 0xf000));
+    sixfive::Pipe::map(m, 0xde00);
+    m.setPC(0x1000);
+    static constexpr uint32_t Slice = 0x01000000;
+    while (m.run(Slice) >= Slice) {}
+    m.policy().pipe.flush();
+    return 0;
 }
 
 int main(int argc, char** argv)
@@ -161,15 +315,37 @@ int main(int argc, char** argv)
     bool checkOpcodes = false;
     bool runFullTest = false;
     bool doBenchmarks = false;
+    bool doProfile = false;
+    bool lazyFlags = false;
     bool disasm = false;
     std::string asmFile;
+    std::string jobFile;
+    std::string filterFile;
+    std::string outFile = "results.txt";
+    unsigned threads = 0;
+    int timeoutMs = 10000;
 
     static CLI::App opts{"sixfive"};
 
     opts.add_flag("--disassemble", disasm, "Disassmble checked opcodes");
     opts.add_flag("-O,--check-opcodes", checkOpcodes, "Check all opcodes");
+    opts.add_flag("-T,--test", doTest, "Run tests");
     opts.add_flag("-B,--benchmarks", doBenchmarks, "Run benchmarks");
     opts.add_flag("-F,--full-test", runFullTest, "Run full 6502 test");
+    opts.add_flag("-L,--lazy-flags", lazyFlags,
+                  "Use lazy carry and overflow flags for full test");
+    opts.add_flag("-P,--profile", doProfile,
+                  "Profile opcode sequences in assembly file");
+
+    opts.add_option("-J,--jobs", jobFile, "Run all jobs in a job manifest");
+    opts.add_option("-o,--output", outFile, "Result file for --jobs");
+    opts.add_option("-t,--threads", threads,
+                    "Threads for --jobs; Default is one per core");
+    opts.add_option("--timeout", timeoutMs,
+                    "Wall clock limit per job in ms for --jobs");
+
+    opts.add_option("--filter", filterFile,
+                    "Run an assembled program as a stdin/stdout filter");
 
     opts.add_flag("-m,--monitor", doMonitor, "Jump into monitor");
     opts.add_option("asmfile", asmFile, "Assembly file to compile");
@@ -178,6 +354,7 @@ int main(int argc, char** argv)
 
     // Run tests
     if (checkOpcodes) checkAllCode(disasm);
+    if (doTest && !runTests()) return 1;
 
     if (doBenchmarks) {
         benchmark::Initialize(&argc, argv);
@@ -185,18 +362,15 @@ int main(int argc, char** argv)
     }
 
     if (runFullTest) {
-        printf("Running full 6502 test...\n");
-        utils::File f{"6502test.bin"};
-        auto data = f.readAll();
-        data[0x3b91] = 0x60;
-        Machine<CheckPolicy> m;
-        m.writeRam(0, &data[0], 0x10000);
-        m.setPC(0x1000);
-        m.run(1000000000);
-        printf("Done.\n");
+        if (!(lazyFlags ? fullTests<true>() : fullTests<false>())) return 1;
     }
 
-    if(runFullTest || doBenchmarks || checkOpcodes)
+    if (doProfile) profile(asmFile);
+
+    if (!jobFile.empty()) return runJobs(jobFile, outFile, threads, timeoutMs);
+    if (!filterFile.empty()) return runFilter(filterFile);
+
+    if(runFullTest || doBenchmarks || checkOpcodes || doProfile || doTest)
         return 0;
 
     Machine<DebugPolicy> m;
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SIXFIVE_MMAP
+#endif
+
+namespace sixfive {
+
+// A RAM image that `GuestMemory` can be loaded from. On Linux the image is
+// kept only in a memory file, that is mapped copy-on-write, so all memories
+// loaded from the same image share its pages until they write to them.
+// Elsewhere it is kept on the heap, and copied in.
+class MemoryImage
+{
+public:
+    MemoryImage(const uint8_t* data, size_t size) : len(size)
+    {
+#ifdef __linux__
+        fd = memfd_create("sixfive", MFD_CLOEXEC);
+        if (fd >= 0 && size > 0 && ::write(fd, data, size) == (ssize_t)size) {
+            auto p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                mem = static_cast<const uint8_t*>(p);
+                return;
+            }
+        }
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        bytes.assign(data, data + size);
+    }
+    ~MemoryImage()
+    {
+#ifdef SIXFIVE_MMAP
+        if (mem) munmap(const_cast<uint8_t*>(mem), len);
+        if (fd >= 0) ::close(fd);
+#endif
+    }
+    MemoryImage(const MemoryImage&) = delete;
+    MemoryImage& operator=(const MemoryImage&) = delete;
+
+    size_t size() const { return len; }
+    const uint8_t* data() const { return mem ? mem : bytes.data(); }
+
+private:
+    friend class GuestMemory;
+    const uint8_t* mem = nullptr;
+    size_t len;
+    std::vector<uint8_t> bytes;
+    int fd = -1;
+};
+
+// A ROM image file, mapped read only. Processes that map the same file
+// share it in the page cache, and nothing is copied. Pass it to
+// `Machine::mapRom()`, and keep it alive for as long as it is mapped.
+class RomFile
+{
+public:
+    explicit RomFile(const std::string& fileName)
+    {
+#ifdef SIXFIVE_MMAP
+        int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("Can not open " + fileName);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                mem = static_cast<const uint8_t*>(p);
+                len = st.st_size;
+            }
+        }
+        ::close(fd);
+        if (mem) return;
+#endif
+        // Not a file we can map; Read it instead
+        std::ifstream f(fileName, std::ios::binary);
+        if (!f) throw std::runtime_error("Can not open " + fileName);
+        bytes.assign(std::istreambuf_iterator<char>(f),
+                     std::istreambuf_iterator<char>());
+        len = bytes.size();
+    }
+    ~RomFile()
+    {
+#ifdef SIXFIVE_MMAP
+        if (mem) munmap(const_cast<uint8_t*>(mem), len);
+#endif
+    }
+    RomFile(const RomFile&) = delete;
+    RomFile& operator=(const RomFile&) = delete;
+
+    const uint8_t* data() const { return mem ? mem : bytes.data(); }
+    size_t size() const { return len; }
+
+private:
+    const uint8_t* mem = nullptr;
+    size_t len = 0;
+    std::vector<uint8_t> bytes;
+};
+
+// Guest RAM in a mapping of its own, so that moving it is just moving a
+// pointer, and adresses into it stay valid. A new mapping is zeroed lazily
+// by the OS as it is touched, but memory reused from the pool is cleared
+// up front (see `release()`).
+class GuestMemory
+{
+public:
+    explicit GuestMemory(size_t size) : len(size)
+    {
+#ifdef SIXFIVE_MMAP
+        if (auto* p = pool()) {
+            auto& kept = p->kept;
+            auto it = std::find_if(kept.begin(), kept.end(),
+                                   [&](auto& k) { return k.second == len; });
+            if (it != kept.end()) {
+                mem = it->first;
+                kept.erase(it);
+                std::memset(mem, 0, len);
+                return;
+            }
+        }
+        auto p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        mem = static_cast<uint8_t*>(p);
+#else
+        mem = static_cast<uint8_t*>(std::calloc(len, 1));
+        if (!mem) throw std::bad_alloc();
+#endif
+    }
+    ~GuestMemory() { release(); }
+
+    GuestMemory(GuestMemory&& op) noexcept
+        : mem(std::exchange(op.mem, nullptr)), len(op.len), file(op.file),
+          loaded(op.loaded)
+    {}
+    GuestMemory& operator=(GuestMemory&& op) noexcept
+    {
+        std::swap(mem, op.mem);
+        std::swap(len, op.len);
+        std::swap(file, op.file);
+        std::swap(loaded, op.loaded);
+        return *this;
+    }
+
+    uint8_t& operator[](size_t i) { return mem[i]; }
+    const uint8_t& operator[](size_t i) const { return mem[i]; }
+
+    uint8_t* data() { return mem; }
+    const uint8_t* data() const { return mem; }
+    uint8_t* begin() { return mem; }
+    uint8_t* end() { return mem + len; }
+    const uint8_t* begin() const { return mem; }
+    const uint8_t* end() const { return mem + len; }
+    size_t size() const { return len; }
+
+    void clear() { std::memset(mem, 0, len); }
+
+    // Back the memory with `fileName`, mapped shared at the same adress.
+    // The contents are read from the file (which is created or grown to
+    // `size()` bytes as needed), and every write goes straight to it, so
+    // it survives the process and other processes can map it too.
+    void mapFile(const std::string& fileName)
+    {
+#ifdef SIXFIVE_MMAP
+        int fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) throw std::runtime_error("Can not open " + fileName);
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 &&
+                  ((size_t)st.st_size >= len || ftruncate(fd, len) == 0) &&
+                  mmap(mem, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                       fd, 0) != MAP_FAILED;
+        ::close(fd);
+        if (!ok) throw std::runtime_error("Can not map " + fileName);
+        file = true;
+#else
+        throw std::runtime_error("Can not map " + fileName);
+#endif
+    }
+
+    bool isFile() const { return file; }
+
+    // Write a file backed memory to disk now, and not just eventually
+    void sync()
+    {
+#ifdef SIXFIVE_MMAP
+        if (file) msync(mem, len, MS_SYNC);
+#endif
+    }
+
+    // Replace the contents with `image`, zero filled or cut to size.
+    // Whole OS pages are mapped from the image when possible, unless the
+    // memory is backed by a file.
+    void load(const MemoryImage& image)
+    {
+        auto size = std::min(len, image.size());
+        size_t mapped = 0;
+#ifdef SIXFIVE_MMAP
+        if (image.fd >= 0 && !file) {
+            auto pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            mapped = size / pageSize * pageSize;
+            if (mapped && mmap(mem, mapped, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_FIXED, image.fd,
+                               0) == MAP_FAILED)
+                mapped = 0;
+            loaded |= mapped > 0;
+        }
+#endif
+        std::memcpy(mem + mapped, image.data() + mapped, size - mapped);
+        std::memset(mem + size, 0, len - size);
+    }
+
+private:
+    void release()
+    {
+        if (!mem) return;
+#ifdef SIXFIVE_MMAP
+        // Plain memory is kept for the next memory made by this thread,
+        // since a new mapping and its page faults cost more than clearing.
+        // In Bench_construct a machine takes 3.2us with the pool, 3.6us if
+        // kept pages are dropped with madvise(MADV_DONTNEED) instead of
+        // cleared, and 6.7us with a new mapping each time.
+        auto* p = pool();
+        if (p && !file && !loaded && p->kept.size() < Pool::Size)
+            p->kept.emplace_back(mem, len);
+        else
+            munmap(mem, len);
+#else
+        std::free(mem);
+#endif
+    }
+
+#ifdef SIXFIVE_MMAP
+    struct Pool
+    {
+        static constexpr size_t Size = 8;
+        std::vector<std::pair<uint8_t*, size_t>> kept;
+        bool& gone;
+        ~Pool()
+        {
+            for (auto& [p, n] : kept)
+                munmap(p, n);
+            gone = true;
+        }
+    };
+    // Null once the pool of this thread is destroyed, for memory that
+    // outlives it, like that of a static machine
+    static Pool* pool()
+    {
+        static thread_local bool gone = false;
+        if (gone) return nullptr;
+        static thread_local Pool p{{}, gone};
+        return &p;
+    }
+#endif
+
+    uint8_t* mem;
+    size_t len;
+    bool file = false;
+    // Pages are mapped from a `MemoryImage`
+    bool loaded = false;
+};
+
+} // namespace sixfive
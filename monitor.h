@@ -35,21 +35,18 @@ constexpr static const char* modeTemplate[] = {
 std::string disasm(uint16_t& org, uint8_t* mem)
 {
 
-    for (const auto& ins : Machine<>::getInstructions()) {
-        for (const auto& op : ins.opcodes) {
-            if (op.code == mem[0]) {
-                int v = 0;
-                auto* orgmem = mem;
-                mem++;
-                if (sixfive::opSize(op.mode) > 1) v = *mem++;
-                if (sixfive::opSize(op.mode) > 2) v = v | (*mem++) << 8;
-                if (op.mode == REL) v = ((int8_t)v) + 2 + org;
-                org += (mem - orgmem);
-                if (op.mode == NONE) return ins.name;
-                return std::string(ins.name) + " " +
-                       utils::format(modeTemplate[op.mode], v);
-            }
-        }
+    const auto& op = Machine<>::opcodeInfo[mem[0]];
+    if (op.name) {
+        int v = 0;
+        auto* orgmem = mem;
+        mem++;
+        if (op.size > 1) v = *mem++;
+        if (op.size > 2) v = v | (*mem++) << 8;
+        if (op.mode == REL) v = ((int8_t)v) + 2 + org;
+        org += (mem - orgmem);
+        if (op.mode == NONE) return op.name;
+        return std::string(op.name) + " " +
+               utils::format(modeTemplate[op.mode], v);
     }
     org++;
     return utils::format("db $%02x", mem[0]);
@@ -97,7 +94,7 @@ template <typename POLICY> void monitor(Machine<POLICY>& m)
         /* } */
 
         if (cmd.name == "trace") {
-            POLICY::doTrace = (cmd.strarg == "on");
+            m.policy().doTrace = (cmd.strarg == "on");
         } else if (cmd.name == "d") {
             if (cmd.args.size() > 0) start = cmd.args[0];
             if (cmd.args.size() > 1)
@@ -106,7 +103,7 @@ template <typename POLICY> void monitor(Machine<POLICY>& m)
                 size = 16;
             uint8_t input[4];
             for (int i = 0; i < size; i++) {
-                m.readMem(start, input, 3);
+                m.peekMem(start, input, 3);
                 auto org = start;
                 auto s = disasm(start, (uint8_t*)input);
                 print("%04x: %s\n", org, s);
@@ -138,7 +135,7 @@ template <typename POLICY> void monitor(Machine<POLICY>& m)
                 size = 16;
             print("%04x : ", start);
             for (int i = 0; i < size; i++)
-                print("%02x ", m.readMem(start + i));
+                print("%02x ", m.peekMem(start + i));
             print("\n");
         } else if (cmd.name == "r") {
             const auto [a, x, y, sr, sp, pc] = m.regs();
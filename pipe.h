@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+namespace sixfive {
+
+// Character IO between a 6502 program and host file descriptors, normally
+// stdin and stdout. Input is read in large chunks, and output is collected
+// and written in large chunks. When there is no input, a read waits up to
+// `waitMs` for some (-1 to wait until there is), so a program polling for
+// input does not spin the host CPU.
+//
+// Registers (repeated every 2 bytes)
+//   0  Read the next input byte, or write an output byte
+//   1  Status; Bit 7 is set if there is input to read, bit 6 if the input
+//      has ended
+class Pipe
+{
+public:
+    explicit Pipe(int in = 0, int out = 1, int waitMs = 100,
+                  size_t bufferSize = 0x10000)
+        : in(in), out(out), waitMs(waitMs), input(bufferSize)
+    {
+        output.reserve(bufferSize);
+    }
+    ~Pipe() { flush(); }
+    Pipe(Pipe&&) = default;
+
+    // Map the registers to `len` bytes from `start`
+    template <typename MACHINE>
+    static void map(MACHINE& m, uint16_t start, unsigned len = 2)
+    {
+        m.mapIO(
+            start, len,
+            [](MACHINE& m, uint16_t adr) -> uint8_t {
+                // Reading takes the input
+                return m.policy().pipe.read(adr);
+            },
+            [](MACHINE& m, uint16_t adr, uint8_t v) {
+                m.policy().pipe.write(adr, v);
+            },
+            2);
+    }
+
+    uint8_t read(unsigned adr)
+    {
+        if (pos == end) fill();
+        if (adr & 1) return (pos < end ? 0x80 : 0) | (ended ? 0x40 : 0);
+        return pos < end ? input[pos++] : 0;
+    }
+
+    void write(unsigned adr, uint8_t v)
+    {
+        if (adr & 1) return;
+        output.push_back(v);
+        if (output.size() == output.capacity()) flush();
+    }
+
+    // Write all collected output
+    void flush()
+    {
+        size_t done = 0;
+        while (done < output.size()) {
+            auto n = ::write(out, output.data() + done, output.size() - done);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                // Can not be written; Drop it
+                break;
+            }
+            done += n;
+        }
+        output.clear();
+    }
+
+private:
+    // Read what there is of the input, waiting up to `waitMs` for some
+    void fill()
+    {
+        if (ended) return;
+        // Output may be what the other end waits for
+        if (!output.empty()) flush();
+        pollfd p{in, POLLIN, 0};
+        if (poll(&p, 1, waitMs) <= 0) return;
+        auto n = ::read(in, input.data(), input.size());
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN) ended = true;
+            return;
+        }
+        ended = n == 0;
+        pos = 0;
+        end = n;
+    }
+
+    int in;
+    int out;
+    int waitMs;
+    std::vector<uint8_t> input;
+    size_t pos = 0;
+    size_t end = 0;
+    bool ended = false;
+    std::vector<uint8_t> output;
+};
+
+} // namespace sixfive
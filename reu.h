@@ -0,0 +1,223 @@
+#pragma once
+
+#include "memory.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+namespace sixfive {
+
+// A RAM expansion unit (like the Commodore 1700/1750), with up to 16MB of
+// memory and a DMA controller that moves data to and from the machine.
+//
+// Transfers are done all at once when started, as `memcpy()` and
+// `memcmp()` where the adresses allow it, and the CPU is stalled one cycle
+// per byte. The $ff00 trigger is not emulated; Transfers start when the
+// command register is written with bit 7 set.
+class Reu
+{
+public:
+    enum Command
+    {
+        STASH, // Machine to expansion
+        FETCH, // Expansion to machine
+        SWAP,
+        VERIFY
+    };
+
+    // `size` must be a power of 2
+    explicit Reu(size_t size = 512 * 1024) : mem(size), mask(size - 1) {}
+
+    // The expansion memory. It can be backed by a file with `mapFile()`.
+    GuestMemory& memory() { return mem; }
+    const GuestMemory& memory() const { return mem; }
+
+    // Map the registers to the page at `start`, repeated every 32 bytes
+    template <typename MACHINE> static void map(MACHINE& m, uint16_t start)
+    {
+        m.mapIO(
+            start, 0x100,
+            [](MACHINE& m, uint16_t adr) -> uint8_t {
+                // Reading the status acknowledges the interrupt
+                return m.policy().reu.read(m, adr);
+            },
+            [](MACHINE& m, uint16_t adr, uint8_t v) {
+                m.policy().reu.write(m, adr, v);
+            },
+            32);
+    }
+
+    template <typename MACHINE> uint8_t read(MACHINE& m, unsigned adr)
+    {
+        switch (adr & 0x1f) {
+        case 0: {
+            auto v = status | (mem.size() > 128 * 1024 ? 0x10 : 0);
+            if (status & 0x80) m.irq(false);
+            status = 0;
+            return v;
+        }
+        case 1: return command;
+        case 2: return cur.c64 & 0xff;
+        case 3: return cur.c64 >> 8;
+        case 4: return cur.reu & 0xff;
+        case 5: return (cur.reu >> 8) & 0xff;
+        case 6: return (cur.reu >> 16) | (~mask >> 16 & 0xf8);
+        case 7: return cur.length & 0xff;
+        case 8: return cur.length >> 8;
+        case 9: return irqMask | 0x1f;
+        case 10: return control | 0x3f;
+        default: return 0xff;
+        }
+    }
+
+    template <typename MACHINE> void write(MACHINE& m, unsigned adr, uint8_t v)
+    {
+        // Adress registers are written to both the current and the
+        // autoload registers
+        auto set = [&](unsigned Registers::*r, unsigned shift) {
+            for (auto* regs : {&cur, &saved})
+                regs->*r = (regs->*r & ~(0xffu << shift)) | (v << shift);
+        };
+        switch (adr & 0x1f) {
+        case 1:
+            command = v;
+            if (v & 0x80) execute(m);
+            break;
+        case 2: set(&Registers::c64, 0); break;
+        case 3: set(&Registers::c64, 8); break;
+        case 4: set(&Registers::reu, 0); break;
+        case 5: set(&Registers::reu, 8); break;
+        case 6: set(&Registers::reu, 16); break;
+        case 7: set(&Registers::length, 0); break;
+        case 8: set(&Registers::length, 8); break;
+        case 9: irqMask = v & 0xe0; break;
+        case 10: control = v & 0xc0; break;
+        default: break;
+        }
+    }
+
+    // Run the transfer set up in the registers
+    template <typename MACHINE> void execute(MACHINE& m)
+    {
+        unsigned len = cur.length ? cur.length : 0x10000;
+        bool fixC64 = control & 0x80;
+        bool fixReu = control & 0x40;
+        auto c64 = cur.c64;
+        auto reu = cur.reu & mask;
+        auto type = command & 3;
+        unsigned done = 0;
+        bool fault = false;
+
+        if (!fixC64 && !fixReu) {
+            // As long runs as the expansion memory allows; The machine
+            // side wraps by itself
+            while (done < len && !fault) {
+                auto n = std::min<size_t>(len - done, mem.size() - reu);
+                auto moved = transfer(m, type, c64, reu, n);
+                fault = moved < n;
+                done += moved;
+                c64 = (c64 + moved) & 0xffff;
+                reu = (reu + moved) & mask;
+            }
+        } else if (type == FETCH && fixReu && !fixC64) {
+            // Fill
+            m.fillMem(c64, mem[reu], len);
+            done = len;
+            c64 = (c64 + len) & 0xffff;
+        } else if (type == STASH && fixC64 && !fixReu) {
+            auto v = m.readMem(c64);
+            while (done < len) {
+                auto n = std::min<size_t>(len - done, mem.size() - reu);
+                std::memset(&mem[reu], v, n);
+                done += n;
+                reu = (reu + n) & mask;
+            }
+        } else {
+            // One byte at a time, for registers that are read or written
+            // repeatedly
+            while (done < len) {
+                fault = transfer(m, type, c64, reu, 1) == 0;
+                if (fault) break;
+                done++;
+                if (!fixC64) c64 = (c64 + 1) & 0xffff;
+                if (!fixReu) reu = (reu + 1) & mask;
+            }
+        }
+        if (fault) {
+            // The adresses are left one past the byte that differed
+            done++;
+            if (!fixC64) c64 = (c64 + 1) & 0xffff;
+            if (!fixReu) reu = (reu + 1) & mask;
+        }
+        m.stall(done);
+
+        if (command & 0x20) {
+            cur = saved;
+        } else {
+            cur.c64 = c64;
+            cur.reu = reu;
+            cur.length = fault ? (len - done) & 0xffff : 1;
+        }
+        command = (command & 0x7f) | 0x10;
+        status |= fault ? 0x20 : 0x40;
+        if ((irqMask & 0x80) && (irqMask & status & 0x60)) {
+            status |= 0x80;
+            m.irq(true);
+        }
+    }
+
+private:
+    // Move `n` bytes between `c64` and `reu`, not past the end of the
+    // expansion memory. Returns the bytes done, which is less than `n` if
+    // a verify failed.
+    template <typename MACHINE>
+    size_t transfer(MACHINE& m, unsigned type, unsigned c64, size_t reu,
+                    size_t n)
+    {
+        auto* p = &mem[reu];
+        if (type == STASH) {
+            m.readMem(c64, p, n);
+            return n;
+        }
+        if (type == FETCH) {
+            m.writeMem(c64, p, n);
+            return n;
+        }
+        std::array<uint8_t, 256> buf;
+        for (size_t i = 0; i < n; i += buf.size()) {
+            auto k = std::min(n - i, buf.size());
+            auto adr = (c64 + i) & 0xffff;
+            m.readMem(adr, buf.data(), k);
+            if (type == SWAP) {
+                m.writeMem(adr, p + i, k);
+                std::memcpy(p + i, buf.data(), k);
+            } else if (std::memcmp(p + i, buf.data(), k) != 0) {
+                return i + std::mismatch(buf.begin(), buf.begin() + k, p + i)
+                               .first -
+                       buf.begin();
+            }
+        }
+        return n;
+    }
+
+    GuestMemory mem;
+    size_t mask;
+
+    struct Registers
+    {
+        unsigned c64 = 0;
+        unsigned reu = 0;
+        unsigned length = 0xffff;
+    };
+    Registers cur;
+    Registers saved;
+
+    uint8_t status = 0;
+    uint8_t command = 0x10;
+    uint8_t irqMask = 0;
+    uint8_t control = 0;
+};
+
+} // namespace sixfive
@@ -0,0 +1,314 @@
+#pragma once
+
+#include "emulator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace sixfive {
+
+// One program run; A program image, the state to start from and a cycle
+// budget
+struct Job
+{
+    std::shared_ptr<const std::vector<uint8_t>> image;
+    uint16_t load = 0x1000;
+    uint16_t pc = 0x1000;
+    uint32_t cycles = 1000000;
+    uint8_t a = 0;
+    uint8_t x = 0;
+    uint8_t y = 0;
+    uint8_t sr = 0x30;
+    uint8_t sp = 0xff;
+    // Bytes written after the image is loaded
+    std::vector<std::pair<uint16_t, std::vector<uint8_t>>> pokes;
+    // Memory returned in the result
+    std::vector<std::pair<uint16_t, uint16_t>> dumps;
+};
+
+struct JobResult
+{
+    enum Status
+    {
+        EXIT,    // Returned from the top of the stack (or stopped by `eachOp`)
+        BUDGET,  // Used up its cycles
+        TIMEOUT, // Stopped by the watchdog
+    };
+    Status status = BUDGET;
+    uint32_t cycles = 0;
+    uint8_t a, x, y, sr, sp;
+    uint16_t pc;
+    std::vector<std::vector<uint8_t>> dumps;
+};
+
+// Read a job manifest. Each line is one job, made of `key=value` pairs:
+//
+//   image=week.bin load=0x1000 pc=0x1000 cycles=5000 a=7 x=10 y=0x74
+//   poke=0x1001:74 dump=0x06:1
+//
+// `image` is a raw binary loaded at `load`, `pc` defaults to `load`,
+// `poke=adr:hexbytes` writes bytes before the job starts and
+// `dump=adr:len` adds a memory range to the result. Lines starting
+// with `#` are comments. Identical images are only read once.
+inline std::vector<Job> readManifest(const std::string& fileName)
+{
+    std::vector<Job> jobs;
+    std::map<std::string, std::shared_ptr<const std::vector<uint8_t>>> images;
+    std::ifstream in(fileName);
+    if (!in) throw std::runtime_error("Can not open " + fileName);
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(in, line)) {
+        lineNo++;
+        std::istringstream words(line);
+        std::string word;
+        Job job;
+        bool hasPc = false;
+        bool empty = true;
+        while (words >> word) {
+            if (word[0] == '#') break;
+            empty = false;
+            auto eq = word.find('=');
+            if (eq == std::string::npos)
+                throw std::runtime_error("Line " + std::to_string(lineNo) +
+                                         ": expected key=value");
+            auto key = word.substr(0, eq);
+            auto value = word.substr(eq + 1);
+            auto num = [&](const std::string& v) { return std::stoul(v, 0, 0); };
+            if (key == "image") {
+                auto& image = images[value];
+                if (!image) {
+                    std::ifstream f(value, std::ios::binary);
+                    if (!f) throw std::runtime_error("Can not open " + value);
+                    image = std::make_shared<const std::vector<uint8_t>>(
+                        std::istreambuf_iterator<char>(f),
+                        std::istreambuf_iterator<char>());
+                }
+                job.image = image;
+            } else if (key == "load")
+                job.load = num(value);
+            else if (key == "pc") {
+                job.pc = num(value);
+                hasPc = true;
+            } else if (key == "cycles")
+                job.cycles = num(value);
+            else if (key == "a")
+                job.a = num(value);
+            else if (key == "x")
+                job.x = num(value);
+            else if (key == "y")
+                job.y = num(value);
+            else if (key == "sr")
+                job.sr = num(value);
+            else if (key == "sp")
+                job.sp = num(value);
+            else if (key == "poke" || key == "dump") {
+                auto colon = value.find(':');
+                if (colon == std::string::npos)
+                    throw std::runtime_error("Line " + std::to_string(lineNo) +
+                                             ": expected adr:value");
+                auto adr = num(value.substr(0, colon));
+                auto arg = value.substr(colon + 1);
+                if (key == "dump") {
+                    job.dumps.emplace_back(adr, num(arg));
+                } else {
+                    if (arg.size() % 2 != 0 ||
+                        arg.find_first_not_of("0123456789abcdefABCDEF") !=
+                            std::string::npos)
+                        throw std::runtime_error(
+                            "Line " + std::to_string(lineNo) +
+                            ": expected pairs of hex digits");
+                    std::vector<uint8_t> bytes;
+                    for (size_t i = 0; i < arg.size(); i += 2)
+                        bytes.push_back(std::stoul(arg.substr(i, 2), 0, 16));
+                    job.pokes.emplace_back(adr, std::move(bytes));
+                }
+            } else
+                throw std::runtime_error("Line " + std::to_string(lineNo) +
+                                         ": unknown key " + key);
+        }
+        if (empty) continue;
+        if (!hasPc) job.pc = job.load;
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+// Runs a list of jobs on a pool of threads, one per core by default.
+// Each thread has its own `Machine` that is restored to a clean snapshot
+// between jobs. Threads take jobs from their own queue, and steal from the
+// other queues when theirs is empty. `POLICY` must set `Snapshots`.
+template <typename POLICY> class JobRunner
+{
+public:
+    // Jobs are run in slices of this many cycles, and the watchdog is
+    // checked between slices
+    static constexpr uint32_t Slice = 1000000;
+
+    explicit JobRunner(unsigned threads = 0,
+                       std::chrono::milliseconds timeout =
+                           std::chrono::milliseconds(10000))
+        : threads(threads ? threads : std::thread::hardware_concurrency()),
+          timeout(timeout)
+    {
+        if (this->threads == 0) this->threads = 1;
+    }
+
+    std::vector<JobResult> run(const std::vector<Job>& jobs)
+    {
+        std::vector<JobResult> results(jobs.size());
+        queues = std::vector<Queue>(threads);
+        // Contiguous ranges of jobs per thread to begin with
+        for (size_t i = 0; i < jobs.size(); i++)
+            queues[i * threads / jobs.size()].jobs.push_back(i);
+
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                pin(t);
+                auto m = std::make_unique<Machine<POLICY>>();
+                m->snapshot();
+                size_t i;
+                while (next(t, i))
+                    results[i] = runJob(*m, jobs[i]);
+            });
+        }
+        for (auto& w : workers)
+            w.join();
+        return results;
+    }
+
+    unsigned threadCount() const { return threads; }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+
+    unsigned threads;
+    std::chrono::milliseconds timeout;
+    std::vector<Queue> queues;
+
+    // Take the next job from our own queue, or steal from the back of
+    // another one
+    bool next(unsigned t, size_t& job)
+    {
+        for (unsigned n = 0; n < threads; n++) {
+            auto& q = queues[(t + n) % threads];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.jobs.empty()) continue;
+            if (n == 0) {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+            } else {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static void pin(unsigned t)
+    {
+#ifdef __linux__
+        auto cores = std::thread::hardware_concurrency();
+        if (cores == 0) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t % cores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    JobResult runJob(Machine<POLICY>& m, const Job& job)
+    {
+        using clock = std::chrono::steady_clock;
+        m.restore();
+        if (job.image) {
+            auto size = std::min<size_t>(job.image->size(), 0x10000 - job.load);
+            m.writeRam(job.load, job.image->data(), size);
+        }
+        for (const auto& [adr, bytes] : job.pokes)
+            m.writeRam(adr, bytes.data(), bytes.size());
+        m.setA(job.a);
+        m.setX(job.x);
+        m.setY(job.y);
+        m.setSR(job.sr);
+        m.setSP(job.sp);
+        m.setPC(job.pc);
+
+        JobResult r;
+        auto deadline = clock::now() + timeout;
+        while (r.cycles < job.cycles) {
+            auto slice = std::min(job.cycles - r.cycles, Slice);
+            auto used = m.run(slice);
+            r.cycles += used;
+            if (used < slice) {
+                r.status = JobResult::EXIT;
+                break;
+            }
+            if (clock::now() > deadline) {
+                r.status = JobResult::TIMEOUT;
+                break;
+            }
+        }
+        std::tie(r.a, r.x, r.y, r.sr, r.sp, r.pc) =
+            std::make_tuple(m.regA(), m.regX(), m.regY(), m.regSR(),
+                            m.regSP(), m.regPC());
+        for (const auto& [adr, len] : job.dumps) {
+            r.dumps.emplace_back(len);
+            m.readMem(adr, r.dumps.back().data(), len);
+        }
+        return r;
+    }
+};
+
+// Write one line per job, in the order of the manifest
+inline void writeResults(std::ostream& out, const std::vector<Job>& jobs,
+                         const std::vector<JobResult>& results)
+{
+    static const char* status[] = {"exit", "budget", "timeout"};
+    char temp[128];
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        snprintf(temp, sizeof(temp),
+                 "%zu %s cycles=%u a=%02x x=%02x y=%02x sr=%02x sp=%02x "
+                 "pc=%04x",
+                 i, status[r.status], r.cycles, r.a, r.x, r.y, r.sr, r.sp,
+                 r.pc);
+        out << temp;
+        for (size_t d = 0; d < r.dumps.size(); d++) {
+            snprintf(temp, sizeof(temp), " %04x:", jobs[i].dumps[d].first);
+            out << temp;
+            for (auto b : r.dumps[d]) {
+                snprintf(temp, sizeof(temp), "%02x", b);
+                out << temp;
+            }
+        }
+        out << "\n";
+    }
+}
+
+} // namespace sixfive
@@ -1,13 +1,26 @@
+#include "batch.h"
+#include "devices.h"
 #include "emulator.h"
+#include "hostfile.h"
+#include "jit.h"
+#include "pipe.h"
+#include "reu.h"
+#include "runner.h"
 #include "zyan-disassembler-engine/Zydis/Zydis.hpp"
 #include <benchmark/benchmark.h>
 
 #include <coreutils/format.h>
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
 #include <vector>
 #include <string>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace sixfive {
 
 struct Result
@@ -61,21 +74,21 @@ template <typename POLICY> void checkCode(bool dis)
     int calls = 0;
     int opcodes = 0;
 
-    for (const auto& i : Machine<POLICY>::getInstructions()) {
-        for (const auto& o : i.opcodes) {
-            auto res = disasm((void*)o.op, r);
-            printf("%s (%d/%d/%d)\n", i.name, r.opcodes, r.calls, r.jumps);
-            if(dis) {
-                for(const auto& line : res) {
-                    printf("    %s\n", (line.c_str()));
-                }
+    for (unsigned code = 0; code < 256; code++) {
+        const auto& info = Machine<POLICY>::opcodeInfo[code];
+        if (!info.name) continue;
+        auto res = disasm((void*)Machine<POLICY>::jumpTable_normal[code].op, r);
+        printf("%s (%d/%d/%d)\n", info.name, r.opcodes, r.calls, r.jumps);
+        if(dis) {
+            for(const auto& line : res) {
+                printf("    %s\n", (line.c_str()));
             }
-
-            jumps += r.jumps;
-            calls += r.calls;
-            opcodes += r.opcodes;
-            count++;
         }
+
+        jumps += r.jumps;
+        calls += r.calls;
+        opcodes += r.opcodes;
+        count++;
     }
     printf("### AVG OPCODES: %d TOTAL OPS/CALLS/JUMPS: %d/%d/%d\n",
            opcodes / count, opcodes, calls, jumps);
@@ -84,15 +97,1005 @@ template <typename POLICY> void checkCode(bool dis)
 }
 
 struct DirectPolicy : sixfive::DefaultPolicy {
-	DirectPolicy(sixfive::Machine<DirectPolicy>&m) {}
     static constexpr int PC_AccessMode = DIRECT;
     static constexpr int Read_AccessMode = DIRECT;
     static constexpr int Write_AccessMode = DIRECT;
 };
 
+struct ThreadedDirectPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = DIRECT;
+    static constexpr int Read_AccessMode = DIRECT;
+    static constexpr int Write_AccessMode = DIRECT;
+    static constexpr int Dispatch = THREADED;
+};
+
+struct ThreadedPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int Dispatch = THREADED;
+};
+
+struct PredecodedDirectPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = DIRECT;
+    static constexpr int Read_AccessMode = DIRECT;
+    static constexpr int Write_AccessMode = DIRECT;
+    static constexpr int Dispatch = PREDECODED;
+};
+
+struct PredecodedPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int Dispatch = PREDECODED;
+};
+
+struct JitDirectPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = DIRECT;
+    static constexpr int Read_AccessMode = DIRECT;
+    static constexpr int Write_AccessMode = DIRECT;
+    static constexpr int Dispatch = JIT;
+};
+
+struct JitPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int Dispatch = JIT;
+};
+
+struct FusedDirectPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = DIRECT;
+    static constexpr int Read_AccessMode = DIRECT;
+    static constexpr int Write_AccessMode = DIRECT;
+    static constexpr bool Superinstructions = true;
+};
+
+struct LazyDirectPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = DIRECT;
+    static constexpr int Read_AccessMode = DIRECT;
+    static constexpr int Write_AccessMode = DIRECT;
+    static constexpr bool LazyFlags = true;
+};
+
+struct FusedThreadedDirectPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = DIRECT;
+    static constexpr int Read_AccessMode = DIRECT;
+    static constexpr int Write_AccessMode = DIRECT;
+    static constexpr int Dispatch = THREADED;
+    static constexpr bool Superinstructions = true;
+};
+
+struct HybridPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int Read_AccessMode = HYBRID;
+    static constexpr int Write_AccessMode = HYBRID;
+};
+
+// Registers that read back what was written, repeated every 64 bytes.
+// They are kept in the policy as `latches[N]`.
+template <unsigned START, int N>
+struct Latch : sixfive::Device<START, START + 0x3ff>
+{
+    template <typename M> static unsigned read(M& m, unsigned adr)
+    {
+        return m.policy().latches[N][adr & 0x3f];
+    }
+    template <typename M> static void write(M& m, unsigned adr, unsigned v)
+    {
+        m.policy().latches[N][adr & 0x3f] = v;
+    }
+};
+
+struct DevicePolicy : sixfive::DefaultPolicy
+{
+    static constexpr int PC_AccessMode = DIRECT;
+    static constexpr int Read_AccessMode = DEVICES;
+    static constexpr int Write_AccessMode = DEVICES;
+    using Devices = sixfive::Devices<Ram<0x0000, 0xcfff>, Latch<0xd000, 0>,
+                                     Latch<0xd400, 1>>;
+    uint8_t latches[2][64] = {};
+};
+
+struct IdlePolicy : sixfive::DefaultPolicy
+{
+    static constexpr bool SkipIdleLoops = true;
+};
+
+struct ReuPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int Read_AccessMode = HYBRID;
+    static constexpr int Write_AccessMode = HYBRID;
+    sixfive::Reu reu;
+};
+
+// `POLICY` with snapshots, for tests that restore the machine
+template <typename POLICY> struct Snapshot : POLICY
+{
+    static constexpr bool Snapshots = true;
+};
+
 void checkAllCode(bool dis)
 {
     checkCode<DirectPolicy>(dis);
+    // Device dispatch should be inlined, without any calls
+    checkCode<DevicePolicy>(dis);
+}
+
+// Tests, run with `--test`. Failures are printed and counted.
+static int failures = 0;
+
+static void expect(bool ok, const char* what)
+{
+    if (ok) return;
+    printf("FAILED: %s\n", what);
+    failures++;
+}
+
+// Batch lanes set the I flag like `Machine` does
+static void testBatchFlags()
+{
+    for (uint8_t op : {0x58, 0x78}) {
+        // sei or cli; cli or sei; jmp *
+        const uint8_t code[] = {uint8_t(op ^ 0x20), op, 0x4c, 0x02, 0x10};
+        sixfive::Machine<DirectPolicy> m;
+        sixfive::MachineBatch<DirectPolicy, 4> batch;
+        m.writeRam(0x1000, code, sizeof(code));
+        batch.writeRam(0x1000, code, sizeof(code));
+        m.setPC(0x1000);
+        batch.setPC(0x1000);
+        m.run(100);
+        batch.run(100);
+        expect(batch.regSR(0) == m.regSR(), "Batch SR after cli/sei");
+    }
+}
+
+// `stop()` from a write callback ends the run right after the opcode, also
+// in the middle of a compiled block. Returns the cycles used.
+template <typename POLICY> static uint32_t testStop(const char* what)
+{
+    // loop: sta $d000 (x4); jmp loop
+    static const uint8_t code[] = {0x8d, 0x00, 0xd0, 0x8d, 0x00, 0xd0,
+                                   0x8d, 0x00, 0xd0, 0x8d, 0x00, 0xd0,
+                                   0x4c, 0x00, 0x10};
+    static unsigned stores;
+    sixfive::Machine<POLICY> m;
+    m.writeRam(0x1000, code, sizeof(code));
+    m.mapWriteCallback(0xd0, 256,
+                       [](sixfive::Machine<POLICY>& m, uint16_t, uint8_t) {
+                           if (++stores == 202) m.stop();
+                       });
+    stores = 0;
+    m.setPC(0x1000);
+    auto used = m.run(100000);
+    printf("%s: %u stores, %u cycles\n", what, stores, used);
+    expect(stores == 202 && used < 2000, what);
+    return used;
+}
+
+// Klaus Dormann's 6502 functional test, from `6502test.bin` in the current
+// directory. The success trap is patched to an RTS, that ends the run as
+// the stack wraps; Failures trap in a loop until the cycles run out.
+// Returns the cycles used, or 0 if the test failed or could not be read.
+// With `POLICY::ProfileOpcodes`, the opcode counts are copied to `profile`.
+template <typename POLICY>
+static uint32_t testKlaus(const char* what,
+                          sixfive::OpcodeProfile* profile = nullptr)
+{
+    static std::vector<uint8_t> data;
+    if (data.empty()) {
+        FILE* fp = fopen("6502test.bin", "rb");
+        if (!fp) {
+            printf("%s: No 6502test.bin, skipped\n", what);
+            return 0;
+        }
+        data.resize(0x10000);
+        data.resize(fread(data.data(), 1, data.size(), fp));
+        fclose(fp);
+        data[0x3b91] = 0x60;
+    }
+    if (data.size() < 0x10000) return 0;
+    auto m = std::make_unique<sixfive::Machine<POLICY>>();
+    m->writeRam(0, data.data(), 0x10000);
+    m->setPC(0x1000);
+    auto used = m->run(200000000);
+    bool ok = m->regPC() == 0x3b92 && used < 200000000;
+    printf("%s: %s, %u cycles\n", what, ok ? "passed" : "FAILED", used);
+    if constexpr (POLICY::ProfileOpcodes) {
+        if (profile) {
+            profile->dispatches = m->opcodeProfile().dispatches;
+            profile->fused = m->opcodeProfile().fused;
+        }
+    }
+    expect(ok, what);
+    return ok ? used : 0;
+}
+
+// A loop that runs often enough to be compiled or cached, and then patches
+// its own immediate operand, an opcode and its store adress. Returns the
+// cycles used.
+template <typename POLICY> static uint32_t testSelfModify(const char* what)
+{
+    // ldy #0
+    // loop: ldx #0
+    // fill: lda #$11; nop; sta $2000,x; inx; cpx #40; bne fill
+    //       iny; cpy #2; beq done
+    //       lda #$21; sta fill+1; lda #$0a (asl a); sta fill+2
+    //       inc fill+5; bne loop
+    // done: jmp *
+    static const uint8_t code[] = {
+        0xa0, 0x00, 0xa2, 0x00, 0xa9, 0x11, 0xea, 0x9d, 0x00, 0x20, 0xe8,
+        0xe0, 0x28, 0xd0, 0xf5, 0xc8, 0xc0, 0x02, 0xf0, 0x0f, 0xa9, 0x21,
+        0x8d, 0x05, 0x10, 0xa9, 0x0a, 0x8d, 0x06, 0x10, 0xee, 0x09, 0x10,
+        0xd0, 0xdf, 0x4c, 0x23, 0x10};
+    sixfive::Machine<POLICY> m;
+    m.writeRam(0x1000, code, sizeof(code));
+    m.setPC(0x1000);
+    auto used = m.run(2000);
+    bool ok = m.regPC() == 0x1023;
+    for (unsigned i = 0; i < 40; i++)
+        ok = ok && m.readRam(0x2000 + i) == 0x11 &&
+             m.readRam(0x2100 + i) == 0x42;
+    expect(ok, what);
+    return used;
+}
+
+template <typename POLICY> struct Profiled : POLICY
+{
+    static constexpr bool ProfileOpcodes = true;
+};
+
+// Superinstructions run the functional test like single opcodes, and
+// count each opcode they run
+static void testFused(uint32_t klaus)
+{
+    expect(testKlaus<FusedDirectPolicy>("Functional test (fused)") == klaus,
+           "Same functional test cycles when fused");
+    expect(testKlaus<FusedThreadedDirectPolicy>(
+               "Functional test (fused, threaded)") == klaus,
+           "Same functional test cycles when fused and threaded");
+    sixfive::OpcodeProfile plain;
+    sixfive::OpcodeProfile fused;
+    testKlaus<Profiled<DirectPolicy>>("Functional test (profiled)", &plain);
+    testKlaus<Profiled<FusedDirectPolicy>>("Functional test (profiled, fused)",
+                                           &fused);
+    expect(fused.fused > 0, "Superinstructions run");
+    expect(plain.dispatches > 0 &&
+               plain.dispatches == fused.dispatches + fused.fused,
+           "Opcodes counted when fused");
+}
+
+// IRQs are held off by the I flag, and taken again after CLI, PLP and RTI
+// for as long as the line is high. NMIs are taken once per signal, even
+// with I set. Both push the status with the B flag clear.
+template <typename POLICY> static void testInterrupts(const char* what)
+{
+    // sei; ldx #$10; loop: dex; bne loop; cli; jmp *
+    static const uint8_t cli[] = {0x78, 0xa2, 0x10, 0xca, 0xd0,
+                                  0xfd, 0x58, 0x4c, 0x07, 0x10};
+    // sei; php; pla; and #$fb; pha; plp; jmp *
+    static const uint8_t plp[] = {0x78, 0x08, 0x68, 0x29, 0xfb,
+                                  0x48, 0x28, 0x4c, 0x07, 0x11};
+    // sei; jmp *
+    static const uint8_t sei[] = {0x78, 0x4c, 0x01, 0x12};
+    // tsx; lda $0101,x; sta $11; inc $10; lda $10; cmp #3; bne +4;
+    // pla; ora #$04; pha; rti
+    static const uint8_t irq[] = {0xba, 0xbd, 0x01, 0x01, 0x85, 0x11, 0xe6,
+                                  0x10, 0xa5, 0x10, 0xc9, 0x03, 0xd0, 0x04,
+                                  0x68, 0x09, 0x04, 0x48, 0x40};
+    // tsx; lda $0101,x; sta $15; inc $14; rti
+    static const uint8_t nmi[] = {0xba, 0xbd, 0x01, 0x01, 0x85,
+                                  0x15, 0xe6, 0x14, 0x40};
+    static const uint8_t vectors[] = {0x00, 0x30, 0x00, 0x00, 0x00, 0x20};
+    sixfive::Machine<POLICY> m;
+    m.writeRam(0x1000, cli, sizeof(cli));
+    m.writeRam(0x1100, plp, sizeof(plp));
+    m.writeRam(0x1200, sei, sizeof(sei));
+    m.writeRam(0x2000, irq, sizeof(irq));
+    m.writeRam(0x3000, nmi, sizeof(nmi));
+    m.writeRam(0xfffa, vectors, sizeof(vectors));
+    auto at = [&](unsigned pc) {
+        return m.regPC() >= pc && m.regPC() < pc + 3;
+    };
+    std::string name = what;
+
+    m.setPC(0x1000);
+    m.setSR(m.regSR() | 0x04);
+    m.irq(true);
+    m.run(40);
+    expect(m.readRam(0x10) == 0, (name + ": IRQ masked").c_str());
+    m.run(1000);
+    expect(m.readRam(0x10) == 3 && at(0x1007) &&
+               (m.readRam(0x11) & 0x34) == 0x20,
+           (name + ": IRQ after CLI and RTI").c_str());
+
+    m.writeRam(0x10, 0);
+    m.setPC(0x1100);
+    m.run(1000);
+    expect(m.readRam(0x10) == 3 && at(0x1107),
+           (name + ": IRQ after PLP").c_str());
+
+    m.irq(false);
+    m.setPC(0x1200);
+    m.run(100);
+    m.nmi();
+    m.run(100);
+    bool once = m.readRam(0x14) == 1;
+    m.run(100);
+    once = once && m.readRam(0x14) == 1;
+    m.nmi();
+    m.run(100);
+    expect(once && m.readRam(0x14) == 2 && at(0x1201) &&
+               (m.readRam(0x15) & 0x34) == 0x24,
+           (name + ": NMI").c_str());
+}
+
+// Events run at the first opcode boundary at or after their cycle, also
+// when scheduled from an event or a write callback, and not at all once
+// cancelled. Boundaries are every 2 cycles in a run of NOPs.
+template <typename POLICY> struct Hybrid : POLICY
+{
+    static constexpr int Read_AccessMode = sixfive::HYBRID;
+    static constexpr int Write_AccessMode = sixfive::HYBRID;
+};
+
+template <typename POLICY> static void testEvents(const char* what)
+{
+    using M = sixfive::Machine<Hybrid<POLICY>>;
+    static uint64_t at[5];
+    static unsigned pcs[5];
+    static uint64_t due;
+    static const uint8_t store[] = {0x8d, 0x00, 0xd0}; // sta $d000
+    M m;
+    m.fillRam(0x1000, 0xea, 0x100);
+    m.writeRam(0x1032, store, sizeof(store));
+    m.setPC(0x1000);
+    std::fill(std::begin(at), std::end(at), 0);
+    static const auto log = [](M& m, int i) {
+        at[i] = m.totalCycles();
+        pcs[i] = m.regPC();
+    };
+    m.schedule(51, [](M& m) {
+        log(m, 0);
+        m.schedule(m.totalCycles() + 5, [](M& m) { log(m, 1); });
+    });
+    auto cancelled = [](M& m) { log(m, 2); };
+    m.schedule(80, cancelled);
+    m.schedule(100, [](M& m) { log(m, 3); });
+    m.cancel(cancelled);
+    m.mapWriteCallback(0xd0, 0x100, [](M& m, uint16_t, uint8_t) {
+        due = m.totalCycles() + 1;
+        m.schedule(due, [](M& m) { log(m, 4); });
+    });
+    m.run(200);
+    std::string name = what;
+    expect(at[0] == 52 && pcs[0] == 0x101a && at[1] == 58 &&
+               pcs[1] == 0x101d && at[3] == 100 && pcs[3] == 0x1032,
+           (name + ": Events on time").c_str());
+    expect(at[2] == 0, (name + ": Cancelled event").c_str());
+    // Due during the store, so run right after it
+    expect(due <= 104 && at[4] == 104 && pcs[4] == 0x1035,
+           (name + ": Event from callback").c_str());
+}
+
+struct ForkPolicy : sixfive::DefaultPolicy
+{
+    static constexpr int Read_AccessMode = HYBRID;
+    static constexpr int Write_AccessMode = HYBRID;
+    uint8_t latch = 0;
+};
+
+// A forked machine shares pages with its parent until either writes to
+// them, and has its own callbacks and decimal mode
+static void testFork()
+{
+    using M = sixfive::Machine<ForkPolicy>;
+    // sed; jmp *
+    static const uint8_t sed[] = {0xf8, 0x4c, 0x01, 0x10};
+    // cld; jmp *
+    static const uint8_t cld[] = {0xd8, 0x4c, 0x01, 0x11};
+    // clc; lda #$09; adc #$01; sta $2001; lda $2100; sta $d000; jmp *
+    static const uint8_t add[] = {0x18, 0xa9, 0x09, 0x69, 0x01, 0x8d,
+                                  0x01, 0x20, 0xad, 0x00, 0x21, 0x8d,
+                                  0x00, 0xd0, 0x4c, 0x0e, 0x12};
+    M m;
+    m.writeRam(0x1000, sed, sizeof(sed));
+    m.writeRam(0x1100, cld, sizeof(cld));
+    m.writeRam(0x1200, add, sizeof(add));
+    m.writeRam(0x2000, 0x11);
+    m.writeRam(0x2100, 0x11);
+    m.writeRam(0x3000, 0x44);
+    m.mapIO(0xd000, 1, nullptr,
+            [](M& m, uint16_t, uint8_t v) { m.policy().latch = v; });
+    m.setPC(0x1000);
+    m.run(20);
+    auto child = m.fork();
+
+    m.setPC(0x1100);
+    m.run(20);
+    m.writeRam(0x2100, 0x22);
+    child->writeRam(0x2100, 0x33);
+    m.setPC(0x1200);
+    m.run(100);
+    child->setPC(0x1200);
+    child->run(100);
+    expect(m.readRam(0x2100) == 0x22 && m.readRam(0x2001) == 0x0a &&
+               m.readRam(0x2000) == 0x11 && m.policy().latch == 0x22 &&
+               m.readMem(0x3000) == 0x44,
+           "Fork parent");
+    expect(child->readRam(0x2100) == 0x33 && child->readRam(0x2001) == 0x10 &&
+               child->readRam(0x2000) == 0x11 &&
+               child->policy().latch == 0x33 && child->readMem(0x3000) == 0x44,
+           "Fork child");
+}
+
+struct IdleRun
+{
+    uint64_t at[2];
+    unsigned pc[2];
+    uint32_t used;
+    uint64_t skips;
+};
+
+// Run `code` at $1000 with events at cycles 1001 and 1500. The first one
+// changes what $d000-$d0ff reads, a steady device. $d100-$d1ff is a device
+// that is not steady.
+template <typename POLICY>
+static IdleRun runIdle(const uint8_t* code, size_t size)
+{
+    using M = sixfive::Machine<Hybrid<POLICY>>;
+    static IdleRun r;
+    static uint8_t raster;
+    r = {};
+    raster = 0;
+    M m;
+    m.writeRam(0x1000, code, size);
+    m.mapReadCallback(0xd0, 0x100, [](M&, uint16_t) { return raster; }, true);
+    m.mapReadCallback(0xd1, 0x100, [](M&, uint16_t) { return uint8_t(0); });
+    m.setPC(0x1000);
+    m.schedule(1001, [](M& m) {
+        r.at[0] = m.totalCycles();
+        r.pc[0] = m.regPC();
+        raster = 0x80;
+    });
+    m.schedule(1500, [](M& m) {
+        r.at[1] = m.totalCycles();
+        r.pc[1] = m.regPC();
+    });
+    r.used = m.run(2000);
+    r.skips = m.runStats().idleSkips;
+    return r;
+}
+
+// Loops that can only change when an event runs are skipped, and reach
+// each event at the same cycle and adress as when they are run. Loops that
+// write memory or read a device that is not steady are run.
+static void testIdleLoops()
+{
+    // jmp *
+    static const uint8_t self[] = {0x4c, 0x00, 0x10};
+    // loop: lda $d012; cmp #$80; bne loop; jmp *
+    static const uint8_t raster[] = {0xad, 0x12, 0xd0, 0xc9, 0x80,
+                                     0xd0, 0xf9, 0x4c, 0x07, 0x10};
+    // lda #$01; loop: sta $10; jmp loop
+    static const uint8_t store[] = {0xa9, 0x01, 0x85, 0x10,
+                                    0x4c, 0x02, 0x10};
+    // loop: lda $d100; cmp #$80; bne loop
+    static const uint8_t device[] = {0xad, 0x00, 0xd1, 0xc9, 0x80,
+                                     0xd0, 0xf9};
+    struct Case
+    {
+        const char* what;
+        const uint8_t* code;
+        size_t size;
+        bool idle;
+    };
+    static const Case cases[] = {
+        {"Skip jmp *", self, sizeof(self), true},
+        {"Skip raster wait", raster, sizeof(raster), true},
+        {"Run loop that stores", store, sizeof(store), false},
+        {"Run loop that reads a device", device, sizeof(device), false}};
+    for (const auto& c : cases) {
+        auto a = runIdle<IdlePolicy>(c.code, c.size);
+        auto b = runIdle<sixfive::DefaultPolicy>(c.code, c.size);
+        bool same = a.used == b.used;
+        for (int i = 0; i < 2; i++)
+            same = same && a.at[i] == b.at[i] && a.pc[i] == b.pc[i];
+        expect(same && (a.skips > 0) == c.idle && b.skips == 0, c.what);
+    }
+}
+
+// `restore()` needs a snapshot, and undoes writes, events, interrupts and
+// bank switches made since it
+static void testRestore()
+{
+    // lda #$42; sta $3000; jmp *
+    static const uint8_t code[] = {0xa9, 0x42, 0x8d, 0x00, 0x30,
+                                   0x4c, 0x05, 0x10};
+    sixfive::Machine<Snapshot<DirectPolicy>> m;
+    bool threw = false;
+    try {
+        m.restore();
+    } catch (std::logic_error&) {
+        threw = true;
+    }
+    expect(threw, "Restore without snapshot");
+    static int fired[2];
+    using M = sixfive::Machine<Snapshot<DirectPolicy>>;
+    m.writeRam(0x1000, code, sizeof(code));
+    m.setPC(0x1000);
+    m.schedule(50, [](M&) { fired[0]++; });
+    m.snapshot();
+    m.run(100);
+    m.setConfig(m.addConfig());
+    m.irq(true);
+    m.nmi();
+    m.schedule(150, [](M&) { fired[1]++; });
+    m.restore();
+    expect(m.readRam(0x3000) == 0 && m.regA() == 0 && m.regPC() == 0x1000,
+           "Restore");
+    expect(m.config() == 0 && m.totalCycles() == 0, "Restore cycles");
+    m.run(200);
+    expect(fired[0] == 2 && fired[1] == 0 && m.regPC() >= 0x1005 &&
+               m.regPC() <= 0x1007,
+           "Restore events and interrupts");
+}
+
+// Make a temporary file holding `text`, and return its name
+static std::string tempFile(const char* text)
+{
+    char name[] = "/tmp/sixfiveXXXXXX";
+    int fd = mkstemp(name);
+    (void)!write(fd, text, strlen(text));
+    close(fd);
+    return name;
+}
+
+// Host file transfers read up to the end of the file, grow it when
+// appending, and refuse writes to a file opened read only
+static void testHostFile()
+{
+    auto name = tempFile("0123456789");
+    sixfive::Machine<DirectPolicy> m;
+    auto command = [&](sixfive::HostFile& f, uint32_t position,
+                       uint16_t adr, uint16_t length, uint8_t cmd) {
+        for (unsigned i = 0; i < 4; i++)
+            f.write(m, 1 + i, position >> i * 8);
+        for (unsigned i = 0; i < 2; i++) {
+            f.write(m, 5 + i, adr >> i * 8);
+            f.write(m, 7 + i, length >> i * 8);
+        }
+        f.write(m, 0, cmd);
+        return f.read(0);
+    };
+    {
+        sixfive::HostFile f(name);
+        auto status = command(f, 4, 0x2000, 8, sixfive::HostFile::READ);
+        char buf[7] = {};
+        m.readRam(0x2000, reinterpret_cast<uint8_t*>(buf), 6);
+        expect(status == 0x80 && f.read(7) == 6 && strcmp(buf, "456789") == 0,
+               "Host file read to the end");
+        status = command(f, 0, 0x2000, 2, sixfive::HostFile::WRITE);
+        expect(status == 0x40 && f.read(7) == 0, "Read only host file");
+    }
+    std::vector<uint8_t> data(0x1000);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = i * 7;
+    m.writeRam(0x3000, data.data(), data.size());
+    {
+        sixfive::HostFile f(name, true);
+        // The second write grows the mapping past the end
+        auto status = command(f, 10, 0x3000, 0x1000, sixfive::HostFile::WRITE);
+        status |= command(f, 0x100a, 0x3000, 0x10, sixfive::HostFile::WRITE);
+        expect(status == 0 && f.size() == 0x101a &&
+                   memcmp(f.data() + 10, data.data(), data.size()) == 0 &&
+                   memcmp(f.data() + 0x100a, data.data(), 0x10) == 0,
+               "Host file append");
+    }
+    struct stat st;
+    stat(name.c_str(), &st);
+    expect(st.st_size == 0x101a, "Host file cut to size when closed");
+    unlink(name.c_str());
+}
+
+// RAM kept in a file starts with its contents, and has what the program
+// wrote in it after a sync
+static void testMapRam()
+{
+    // lda #$42; sta $1234; jmp *
+    static const uint8_t code[] = {0xa9, 0x42, 0x8d, 0x34, 0x12,
+                                   0x4c, 0x05, 0x10};
+    auto name = tempFile("Hello");
+    sixfive::Machine<DirectPolicy> m;
+    m.mapRam(name);
+    expect(m.readRam(0) == 'H' && m.readRam(4) == 'o', "Mapped RAM contents");
+    m.writeRam(0x1000, code, sizeof(code));
+    m.setPC(0x1000);
+    m.run(100);
+    m.syncRam();
+    std::vector<uint8_t> data(0x20000);
+    FILE* fp = fopen(name.c_str(), "rb");
+    auto n = fread(data.data(), 1, data.size(), fp);
+    fclose(fp);
+    expect(n == 0x10000 && data[0x1234] == 0x42 && data[0x1000] == 0xa9,
+           "Mapped RAM synced to file");
+    unlink(name.c_str());
+}
+
+// A mapped ROM file is seen by reads, and writes to it go to the RAM under
+// it and leave the file alone
+static void testRomFile()
+{
+    // lda $a001; sta $10; lda #$55; sta $a001; lda $a001; sta $11; jmp *
+    static const uint8_t code[] = {0xad, 0x01, 0xa0, 0x85, 0x10, 0xa9,
+                                   0x55, 0x8d, 0x01, 0xa0, 0xad, 0x01,
+                                   0xa0, 0x85, 0x11, 0x4c, 0x0f, 0x10};
+    std::string text(512, 'R');
+    auto name = tempFile(text.c_str());
+    {
+        sixfive::RomFile rom(name);
+        sixfive::Machine<HybridPolicy> m;
+        m.mapRom(0xa0, rom);
+        m.writeRam(0x1000, code, sizeof(code));
+        m.setPC(0x1000);
+        m.run(100);
+        expect(m.readRam(0x10) == 'R' && m.readRam(0x11) == 'R' &&
+                   m.readMem(0xa001) == 'R',
+               "Writes to ROM file dropped");
+        expect(rom.data()[1] == 'R', "ROM file unchanged");
+    }
+    FILE* fp = fopen(name.c_str(), "rb");
+    expect(fgetc(fp) == 'R' && fgetc(fp) == 'R', "ROM file on disk unchanged");
+    fclose(fp);
+    unlink(name.c_str());
+}
+
+// A failed verify leaves the adresses one past the byte that differed
+static void testReuVerify()
+{
+    sixfive::Machine<ReuPolicy> m;
+    auto& reu = m.policy().reu;
+    for (unsigned fixed : {0x00, 0x40}) {
+        std::vector<uint8_t> data(32, 7);
+        m.writeRam(0x2000, data.data(), data.size());
+        m.writeRam(0x2005, 8);
+        std::fill_n(&reu.memory()[0x100], 32, 7);
+        // c64 $2000, reu $000100, 32 bytes
+        for (auto [r, v] : {std::pair{2, 0x00}, {3, 0x20}, {4, 0x00},
+                            {5, 0x01}, {6, 0x00}, {7, 32}, {8, 0}})
+            reu.write(m, r, v);
+        reu.write(m, 10, fixed);
+        reu.write(m, 1, 0x80 | sixfive::Reu::VERIFY);
+        bool fixReu = fixed & 0x40;
+        expect((reu.read(m, 0) & 0x20) && reu.read(m, 2) == 6 &&
+                   reu.read(m, 4) == (fixReu ? 0 : 6) && reu.read(m, 7) == 26,
+               fixReu ? "Verify fault (fixed reu)" : "Verify fault");
+    }
+}
+
+// Machines loaded from one image see it, and not each others writes
+static void testLoadImage()
+{
+    std::vector<uint8_t> data(0x1234);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = i * 3;
+    sixfive::MemoryImage image(data.data(), data.size());
+    sixfive::Machine<DirectPolicy> m0;
+    sixfive::Machine<DirectPolicy> m1;
+    m0.writeRam(0x2000, 0x55);
+    m0.load(image);
+    m1.load(image);
+    m0.writeRam(0x0010, 0xaa);
+    m0.writeRam(0x1230, 0xaa);
+    expect(m1.readRam(0x0010) == 0x30 && m1.readRam(0x1230) == 0x90 &&
+               m0.readRam(0x1233) == 0x99 && m0.readRam(0x2000) == 0 &&
+               image.data()[0x10] == 0x30,
+           "Load image");
+}
+
+// Device ids are bytes, so there can be no more than 255 devices
+static void testDeviceLimit()
+{
+    sixfive::Machine<HybridPolicy> m;
+    auto read = [](sixfive::Machine<HybridPolicy>&, uint16_t a) {
+        return uint8_t(a);
+    };
+    bool threw = false;
+    try {
+        for (unsigned i = 0; i < 256; i++)
+            m.mapIO(0xd000 + i, 1, read, nullptr);
+    } catch (std::length_error&) {
+        threw = true;
+    }
+    expect(threw && m.readMem(0xd0fe) == 0xfe && m.readMem(0xd0ff) == 0,
+           "Device limit");
+}
+
+// Moves match copying through a buffer, for overlapping ranges in both
+// directions, across pages and around $ffff. Moves through IO write the
+// bytes to the device in order.
+static void testMove()
+{
+    static const int moves[][3] = {{0x1010, 0x1000, 0x300},
+                                   {0x1000, 0x1010, 0x300},
+                                   {0x20ff, 0x2001, 0x102},
+                                   {0x0010, 0xff80, 0x100},
+                                   {0xff80, 0x0010, 0x100},
+                                   {0x3000, 0x3000, 0x80}};
+    bool ok = true;
+    for (int mem = 0; mem < 2; mem++) {
+        sixfive::Machine<HybridPolicy> m;
+        std::vector<uint8_t> ref(0x10000);
+        for (unsigned i = 0; i < ref.size(); i++)
+            ref[i] = i * 7 + (i >> 8);
+        m.writeRam(0, ref.data(), 0x10000);
+        for (const auto& mv : moves) {
+            std::vector<uint8_t> temp(mv[2]);
+            for (int i = 0; i < mv[2]; i++)
+                temp[i] = ref[(mv[1] + i) & 0xffff];
+            for (int i = 0; i < mv[2]; i++)
+                ref[(mv[0] + i) & 0xffff] = temp[i];
+            if (mem)
+                m.moveMem(mv[0], mv[1], mv[2]);
+            else
+                m.moveRam(mv[0], mv[1], mv[2]);
+        }
+        std::vector<uint8_t> data(0x10000);
+        m.readRam(0, data.data(), 0x10000);
+        ok = ok && data == ref;
+    }
+    expect(ok, "Move memory");
+
+    static std::vector<uint8_t> written;
+    sixfive::Machine<HybridPolicy> m;
+    auto write = [](sixfive::Machine<HybridPolicy>&, uint16_t, uint8_t v) {
+        written.push_back(v);
+    };
+    m.mapIO(0xd000, 4, nullptr, write);
+    static const uint8_t data[] = {1, 2, 3, 4};
+    m.writeRam(0x10fe, data, 4);
+    m.moveMem(0xd000, 0x10fe, 4);
+    expect(written == std::vector<uint8_t>(data, data + 4), "Move to IO");
+}
+
+// Switching configurations switches what reads see, and only to
+// configurations that exist
+static void testConfigs()
+{
+    static const std::vector<uint8_t> rom(0x2000, 0xea);
+    sixfive::Machine<HybridPolicy> m;
+    m.writeRam(0xa000, 0x42);
+    auto roms = m.addConfig();
+    m.setConfig(roms);
+    m.mapRom(0xa0, rom.data(), rom.size());
+    bool ok = m.readMem(0xa000) == 0xea;
+    m.setConfig(0);
+    ok = ok && m.readMem(0xa000) == 0x42;
+    m.setConfig(roms);
+    ok = ok && m.readMem(0xbfff) == 0xea;
+    expect(ok, "Switch configurations");
+    bool threw = false;
+    try {
+        m.setConfig(roms + 1);
+    } catch (std::out_of_range&) {
+        threw = true;
+    }
+    expect(threw && m.config() == roms, "No such configuration");
+}
+
+// A device mirrored every 64 bytes is called with the adress in the first
+// copy. Without a callback, that direction goes to RAM, also mirrored.
+static void testMapIO()
+{
+    using M = sixfive::Machine<HybridPolicy>;
+    static unsigned readAt, writeAt;
+    auto read = [](M&, uint16_t adr) {
+        readAt = adr;
+        return uint8_t(adr);
+    };
+    auto write = [](M&, uint16_t adr, uint8_t) { writeAt = adr; };
+    // lda $d345; sta $10; jmp *
+    static const uint8_t code[] = {0xad, 0x45, 0xd3, 0x85, 0x10,
+                                   0x4c, 0x05, 0x10};
+    M m;
+    m.mapIO(0xd000, 0x400, read, write, 64);
+    m.mapIO(0xde00, 0x100, nullptr, write);
+    m.mapIO(0xdf00, 0x100, read, nullptr, 0x10);
+    m.writeRam(0x1000, code, sizeof(code));
+    m.setPC(0x1000);
+    m.run(20);
+    bool ok = readAt == 0xd005 && m.readRam(0x10) == 0x05;
+    ok = ok && m.readMem(0xd0c7) == 0x07 && readAt == 0xd007;
+    const uint8_t v = 0x77;
+    m.writeMem(0xd3ff, &v, 1);
+    expect(ok && writeAt == 0xd03f, "Mirrored IO");
+
+    m.writeRam(0xde10, 0x99);
+    m.writeMem(0xde10, &v, 1);
+    ok = m.readMem(0xde10) == 0x99 && writeAt == 0xde10;
+    m.writeMem(0xdf25, &v, 1);
+    ok = ok && m.readRam(0xdf05) == 0x77 && m.readRam(0xdf25) == 0 &&
+         m.readMem(0xdf25) == 0x05 && readAt == 0xdf05;
+    expect(ok, "IO without callbacks");
+}
+
+// Peeking shows the RAM under IO, and does not read the device
+static void testPeek()
+{
+    static int reads = 0;
+    sixfive::Machine<HybridPolicy> m;
+    m.writeRam(0xd000, 0x42);
+    m.writeRam(0xd001, 0x43);
+    auto read = [](sixfive::Machine<HybridPolicy>&, uint16_t) {
+        reads++;
+        return uint8_t(0xff);
+    };
+    m.mapIO(0xd000, 2, read, nullptr);
+    uint8_t data[3];
+    m.peekMem(0xcfff, data, 3);
+    expect(m.peekMem(0xd000) == 0x42 && data[1] == 0x42 && data[2] == 0x43 &&
+               reads == 0,
+           "Peek without reading devices");
+    expect(m.readMem(0xd000) == 0xff && reads == 1, "Read device");
+}
+
+// Jobs from a manifest end by returning, running out of cycles or timing
+// out, and are written one line each. Pokes must be whole bytes.
+static void testRunner()
+{
+    using Runner = sixfive::JobRunner<Snapshot<sixfive::DefaultPolicy>>;
+    // lda #$07; sta $2000; rts
+    auto name = tempFile("# Returns, and runs out of cycles\n"
+                         "poke=0x1000:a9078d002060 dump=0x2000:2\n"
+                         "\n"
+                         "poke=0x1000:4c0010 cycles=1000 x=5\n");
+    auto jobs = sixfive::readManifest(name);
+    unlink(name.c_str());
+    expect(jobs.size() == 2 && jobs[0].pokes.size() == 1 &&
+               jobs[0].pokes[0].second.size() == 6 && jobs[1].pc == 0x1000 &&
+               jobs[1].cycles == 1000 && jobs[1].x == 5,
+           "Read manifest");
+    auto results = Runner(1).run(jobs);
+    std::ostringstream out;
+    sixfive::writeResults(out, jobs, results);
+    expect(out.str() == "0 exit cycles=6 a=07 x=00 y=00 sr=30 sp=ff pc=1006 "
+                        "2000:0700\n"
+                        "1 budget cycles=1002 a=00 x=05 y=00 sr=30 sp=ff "
+                        "pc=1000\n",
+           "Run jobs");
+
+    jobs.resize(1);
+    jobs[0].cycles = 100000000;
+    jobs[0].dumps.clear();
+    jobs[0].pokes[0].second = {0x4c, 0x00, 0x10};
+    results = Runner(1, std::chrono::milliseconds(0)).run(jobs);
+    expect(results[0].status == sixfive::JobResult::TIMEOUT &&
+               results[0].cycles < jobs[0].cycles,
+           "Job timeout");
+
+    name = tempFile("cycles=10\npoke=0x1000:a90\n");
+    std::string error;
+    try {
+        sixfive::readManifest(name);
+    } catch (std::runtime_error& e) {
+        error = e.what();
+    }
+    unlink(name.c_str());
+    expect(error.rfind("Line 2:", 0) == 0, "Odd poke in manifest");
+}
+
+struct PipePolicy : sixfive::DefaultPolicy
+{
+    static constexpr int Read_AccessMode = HYBRID;
+    static constexpr int Write_AccessMode = HYBRID;
+    static inline int fds[2];
+    sixfive::Pipe pipe{fds[0], fds[1], 10};
+};
+
+// A program copying its input to its output sees all of it, and then the
+// end of it
+static void testPipe()
+{
+    // loop: lda $de01; bmi copy; and #$40; beq loop; jmp *
+    // copy: lda $de00; sta $de00; jmp loop
+    static const uint8_t code[] = {0xad, 0x01, 0xde, 0x30, 0x07, 0x29, 0x40,
+                                   0xf0, 0xf7, 0x4c, 0x09, 0x10, 0xad, 0x00,
+                                   0xde, 0x8d, 0x00, 0xde, 0x4c, 0x00, 0x10};
+    static const char text[] = "Hello pipe\n";
+    int in[2];
+    int out[2];
+    if (pipe(in) != 0 || pipe(out) != 0) return expect(false, "Pipe");
+    (void)!write(in[1], text, strlen(text));
+    close(in[1]);
+    PipePolicy::fds[0] = in[0];
+    PipePolicy::fds[1] = out[1];
+    {
+        sixfive::Machine<PipePolicy> m;
+        m.writeRam(0x1000, code, sizeof(code));
+        sixfive::Pipe::map(m, 0xde00);
+        m.setPC(0x1000);
+        m.run(10000);
+        expect(m.policy().pipe.read(1) == 0x40, "Pipe ended");
+    }
+    char buf[64] = {};
+    auto n = read(out[0], buf, sizeof(buf) - 1);
+    expect(n == (ssize_t)strlen(text) && strcmp(buf, text) == 0,
+           "Pipe echoes input");
+    for (int fd : {in[0], out[0], out[1]})
+        close(fd);
+}
+
+bool runTests()
+{
+    failures = 0;
+    testBatchFlags();
+    auto table = testStop<DefaultPolicy>("Stop from callback (table)");
+    auto threaded = testStop<ThreadedPolicy>("Stop from callback (threaded)");
+    expect(threaded == table, "Same cycles when threaded");
+    testStop<PredecodedPolicy>("Stop from callback (predecoded)");
+#if SIXFIVE_JIT
+    testStop<JitPolicy>("Stop from callback (jit)");
+#endif
+    auto klaus = testKlaus<DirectPolicy>("Functional test (table)");
+    if (klaus) {
+        expect(testKlaus<ThreadedDirectPolicy>("Functional test (threaded)") ==
+                   klaus,
+               "Same functional test cycles when threaded");
+        expect(testKlaus<PredecodedDirectPolicy>(
+                   "Functional test (predecoded)") == klaus,
+               "Same functional test cycles when predecoded");
+        testFused(klaus);
+#if SIXFIVE_JIT
+        expect(testKlaus<JitDirectPolicy>("Functional test (jit)") == klaus,
+               "Same functional test cycles with jit");
+        expect(testKlaus<JitPolicy>("Functional test (jit, callbacks)") ==
+                   klaus,
+               "Same functional test cycles with jit and callbacks");
+#endif
+    }
+    auto modify = testSelfModify<DefaultPolicy>("Self modifying code (table)");
+    expect(testSelfModify<PredecodedPolicy>(
+               "Self modifying code (predecoded)") == modify,
+           "Same cycles for self modifying code when predecoded");
+    expect(testSelfModify<PredecodedDirectPolicy>(
+               "Self modifying code (predecoded direct)") == modify,
+           "Same cycles for self modifying code when predecoded direct");
+#if SIXFIVE_JIT
+    expect(testSelfModify<JitPolicy>("Self modifying code (jit)") == modify,
+           "Same cycles for self modifying code with jit");
+    expect(testSelfModify<JitDirectPolicy>(
+               "Self modifying code (jit direct)") == modify,
+           "Same cycles for self modifying code with direct jit");
+#endif
+    testInterrupts<DefaultPolicy>("Interrupts (table)");
+    testInterrupts<ThreadedPolicy>("Interrupts (threaded)");
+    testInterrupts<PredecodedPolicy>("Interrupts (predecoded)");
+#if SIXFIVE_JIT
+    testInterrupts<JitPolicy>("Interrupts (jit)");
+#endif
+    testEvents<sixfive::DefaultPolicy>("Events (table)");
+    testEvents<ThreadedPolicy>("Events (threaded)");
+    testEvents<PredecodedPolicy>("Events (predecoded)");
+#if SIXFIVE_JIT
+    testEvents<JitPolicy>("Events (jit)");
+#endif
+    testIdleLoops();
+    testRestore();
+    testFork();
+    testHostFile();
+    testMapRam();
+    testMove();
+    testRomFile();
+    testReuVerify();
+    testLoadImage();
+    testDeviceLimit();
+    testConfigs();
+    testMapIO();
+    testPeek();
+    testPipe();
+    testRunner();
+    printf("%s\n", failures ? "Tests failed" : "All tests passed");
+    return failures == 0;
 }
 
 /*
@@ -120,6 +1123,9 @@ uint32_t Machine::runDebug(uint32_t runc) {
 */
 //} // namespace
 
+// With `EVERY` set, an event is also run every `EVERY` cycles, like a
+// timer or raster interrupt would be
+template <typename POLICY, int EVERY = 0>
 static void Bench_sort(benchmark::State& state)
 {
 
@@ -137,7 +1143,7 @@ static void Bench_sort(benchmark::State& state)
         220, 50, 30,  20,  67,  111, 109, 175, 4,   66, 100,
     };
 
-    sixfive::Machine<DirectPolicy> m;
+    sixfive::Machine<Snapshot<POLICY>> m;
     for (int i = 0; i < (int)sizeof(data); i++)
         m.writeRam(0x2000 + i, data[i]);
     for (int i = 0; i < (int)sizeof(sortCode); i++)
@@ -146,17 +1152,102 @@ static void Bench_sort(benchmark::State& state)
     m.writeRam(0x31, 0x20);
     m.writeRam(0x2000, sizeof(data) - 1);
     m.setPC(0x1000);
+    m.snapshot();
+    if constexpr (EVERY > 0) {
+        static uint64_t next;
+        struct Timer
+        {
+            static void tick(sixfive::Machine<Snapshot<POLICY>>& m)
+            {
+                next += EVERY;
+                m.schedule(next, &tick);
+            }
+        };
+        next = EVERY;
+        m.schedule(next, &Timer::tick);
+    }
     printf("Opcodes %d\n", m.run(50000000));
     while (state.KeepRunning()) {
-        for (int i = 1; i < (int)sizeof(data); i++)
-            m.writeRam(0x2000 + i, data[i]);
-        m.setPC(0x1000);
+        m.restore();
         m.run(5000000);
     }
 }
-BENCHMARK(Bench_sort);
+BENCHMARK_TEMPLATE(Bench_sort, DirectPolicy);
+BENCHMARK_TEMPLATE(Bench_sort, ThreadedDirectPolicy);
+BENCHMARK_TEMPLATE(Bench_sort, PredecodedDirectPolicy);
+#if SIXFIVE_JIT
+BENCHMARK_TEMPLATE(Bench_sort, JitDirectPolicy);
+#endif
+BENCHMARK_TEMPLATE(Bench_sort, FusedDirectPolicy);
+BENCHMARK_TEMPLATE(Bench_sort, FusedThreadedDirectPolicy);
+BENCHMARK_TEMPLATE(Bench_sort, LazyDirectPolicy);
+BENCHMARK_TEMPLATE(Bench_sort, DirectPolicy, 63);
+
+// A busy loop interrupted every `EVERY` cycles. The handler acknowledges
+// the interrupt by writing to $d000. At 1MHz, 20000 and 16667 cycles are
+// 50 and 60Hz, and 100 cycles is 10kHz. With `IDLE` set, the main program
+// only waits for interrupts.
+template <typename POLICY, int EVERY, bool IDLE = false>
+static void Bench_irq(benchmark::State& state)
+{
+    using M = sixfive::Machine<POLICY>;
+
+    // cli; loop: inx; bne loop; iny; jmp loop
+    static const uint8_t mainCode[] = {0x58, 0xe8, 0xd0, 0xfd,
+                                       0xc8, 0x4c, 0x01, 0x10};
+    // cli; jmp *
+    static const uint8_t idleCode[] = {0x58, 0x4c, 0x01, 0x10};
+    // inc $40; sta $d000; rti
+    static const uint8_t irqCode[] = {0xe6, 0x40, 0x8d, 0x00, 0xd0, 0x40};
+
+    M m;
+    if (IDLE)
+        m.writeRam(0x1000, idleCode, sizeof(idleCode));
+    else
+        m.writeRam(0x1000, mainCode, sizeof(mainCode));
+    m.writeRam(0x0300, irqCode, sizeof(irqCode));
+    m.writeRam(0xfffe, 0x00);
+    m.writeRam(0xffff, 0x03);
+    m.setSR(0x34);
+    m.setPC(0x1000);
+
+    static uint64_t next;
+    static unsigned acks;
+    struct Timer
+    {
+        static void tick(M& m)
+        {
+            m.irq(true);
+            next += EVERY;
+            m.schedule(next, &tick);
+        }
+        static void ack(M& m, uint16_t, uint8_t)
+        {
+            acks++;
+            m.irq(false);
+        }
+    };
+    m.mapWriteCallback(0xd0, 256, &Timer::ack);
+    if constexpr (EVERY > 0) {
+        next = EVERY;
+        m.schedule(next, &Timer::tick);
+    }
+    while (state.KeepRunning()) {
+        acks = 0;
+        m.run(1000000);
+    }
+    state.counters["irqs"] = acks;
+    state.counters["skipped"] = benchmark::Counter(
+        m.runStats().idleCycles, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK_TEMPLATE(Bench_irq, DefaultPolicy, 0);
+BENCHMARK_TEMPLATE(Bench_irq, DefaultPolicy, 20000);
+BENCHMARK_TEMPLATE(Bench_irq, DefaultPolicy, 16667);
+BENCHMARK_TEMPLATE(Bench_irq, DefaultPolicy, 100);
+BENCHMARK_TEMPLATE(Bench_irq, DefaultPolicy, 20000, true);
+BENCHMARK_TEMPLATE(Bench_irq, IdlePolicy, 20000, true);
 
-static void Bench_emulate(benchmark::State& state)
+template <typename POLICY> static void Bench_emulate(benchmark::State& state)
 {
 
     static const unsigned char WEEK[] = {
@@ -166,7 +1257,7 @@ static void Bench_emulate(benchmark::State& state)
         0x4a, 0x4a, 0x18, 0x65, 0x06, 0x69, 0x07, 0x90, 0xfc, 0x60, 0x01,
         0x05, 0x06, 0x03, 0x01, 0x05, 0x03, 0x00, 0x04, 0x02, 0x06, 0x04};
 
-    sixfive::Machine<> m;
+    sixfive::Machine<POLICY> m;
     for (int i = 0; i < (int)sizeof(WEEK); i++)
         m.writeRam(0x1000 + i, WEEK[i]);
     m.setPC(0x1000);
@@ -177,22 +1268,176 @@ static void Bench_emulate(benchmark::State& state)
     }
 };
 
-BENCHMARK(Bench_emulate);
+BENCHMARK_TEMPLATE(Bench_emulate, DefaultPolicy);
+BENCHMARK_TEMPLATE(Bench_emulate, HybridPolicy);
+BENCHMARK_TEMPLATE(Bench_emulate, DevicePolicy);
+BENCHMARK_TEMPLATE(Bench_emulate, ThreadedPolicy);
+BENCHMARK_TEMPLATE(Bench_emulate, PredecodedPolicy);
+#if SIXFIVE_JIT
+BENCHMARK_TEMPLATE(Bench_emulate, JitPolicy);
+#endif
+
+// Weekday of 32 different dates, in a `MachineBatch` or one `Machine` at a
+// time
+static const uint8_t WEEK[] = {
+    0xa0, 0x74, 0xa2, 0x0a, 0xa9, 0x07, 0x20, 0x0a, 0x10, 0x60, 0xe0,
+    0x03, 0xb0, 0x01, 0x88, 0x49, 0x7f, 0xc0, 0xc8, 0x7d, 0x2a, 0x10,
+    0x85, 0x06, 0x98, 0x20, 0x26, 0x10, 0xe5, 0x06, 0x85, 0x06, 0x98,
+    0x4a, 0x4a, 0x18, 0x65, 0x06, 0x69, 0x07, 0x90, 0xfc, 0x60, 0x01,
+    0x05, 0x06, 0x03, 0x01, 0x05, 0x03, 0x00, 0x04, 0x02, 0x06, 0x04};
+
+static void Bench_batch(benchmark::State& state)
+{
+    auto m = std::make_unique<sixfive::MachineBatch<DirectPolicy, 32>>();
+    while (state.KeepRunning()) {
+        m->writeRam(0x1000, WEEK, sizeof(WEEK));
+        for (int i = 0; i < 32; i++) {
+            m->writeRam(i, 0x1003, 1 + i % 12);
+            m->writeRam(i, 0x1005, 1 + i);
+        }
+        m->setPC(0x1000);
+        m->run(5000);
+    }
+}
+BENCHMARK(Bench_batch);
+
+static void Bench_batchScalar(benchmark::State& state)
+{
+    sixfive::Machine<DirectPolicy> m;
+    m.writeRam(0x1000, WEEK, sizeof(WEEK));
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 32; i++) {
+            m.writeRam(0x1003, 1 + i % 12);
+            m.writeRam(0x1005, 1 + i);
+            m.setPC(0x1000);
+            m.run(5000);
+        }
+    }
+}
+BENCHMARK(Bench_batchScalar);
+
+// Fork a machine with a program loaded, and run the program in the child.
+// Reports the bytes each child copied from shared pages, on top of the
+// `Machine` itself.
+static void Bench_fork(benchmark::State& state)
+{
+    sixfive::Machine<> m;
+    m.writeRam(0x1000, WEEK, sizeof(WEEK));
+    m.setPC(0x1000);
+    uint64_t copied = 0;
+    while (state.KeepRunning()) {
+        auto child = m.fork();
+        child->run(5000);
+        copied += (256 - child->sharedPages()) * 256;
+    }
+    state.counters["copied"] = (double)copied / state.iterations();
+    state.counters["machine"] = sizeof(sixfive::Machine<>);
+}
+BENCHMARK(Bench_fork);
+
+static void Bench_construct(benchmark::State& state)
+{
+    while (state.KeepRunning()) {
+        sixfive::Machine<> m;
+        m.writeRam(0x1000, WEEK, sizeof(WEEK));
+    }
+    state.counters["machine"] = sizeof(sixfive::Machine<>);
+}
+BENCHMARK(Bench_construct);
+
+static void Bench_move(benchmark::State& state)
+{
+    sixfive::Machine<> m;
+    while (state.KeepRunning()) {
+        auto n = std::move(m);
+        m = std::move(n);
+    }
+}
+BENCHMARK(Bench_move);
+
+// Load a 16K program and read back a 1000 byte screen, with the range
+// functions or one byte at a time
+template <bool BULK> static void Bench_transfer(benchmark::State& state)
+{
+    sixfive::Machine<> m;
+    std::vector<uint8_t> image(0x4000, 0xea);
+    std::vector<uint8_t> screen(1000);
+    while (state.KeepRunning()) {
+        if (BULK) {
+            m.writeRam(0x0801, image.data(), image.size());
+            m.readMem(0x0400, screen.data(), screen.size());
+        } else {
+            for (size_t i = 0; i < image.size(); i++)
+                m.writeRam(0x0801 + i, image[i]);
+            for (size_t i = 0; i < screen.size(); i++)
+                screen[i] = m.readMem(0x0400 + i);
+        }
+        benchmark::DoNotOptimize(screen.data());
+    }
+}
+BENCHMARK_TEMPLATE(Bench_transfer, false);
+BENCHMARK_TEMPLATE(Bench_transfer, true);
+
+// Switch between ROM and RAM at $a000-$bfff and $e000-$ffff, with
+// configurations or by mapping each bank again
+template <bool CONFIGS> static void Bench_bankswitch(benchmark::State& state)
+{
+    sixfive::Machine<HybridPolicy> m;
+    static const std::vector<uint8_t> rom(0x2000, 0xea);
+    auto mapRoms = [&] {
+        m.mapRom(0xa0, rom.data(), rom.size());
+        m.mapRom(0xe0, rom.data(), rom.size());
+    };
+    auto roms = m.addConfig();
+    m.setConfig(roms);
+    mapRoms();
+    unsigned n = 0;
+    while (state.KeepRunning()) {
+        n++;
+        if (CONFIGS)
+            m.setConfig(n & 1);
+        else if (n & 1)
+            mapRoms();
+        else
+            for (unsigned p : {0xa0, 0xe0})
+                m.mapRom(p, &m.Ram(p << 8), 0x2000);
+        benchmark::DoNotOptimize(m.readMem(0xa000));
+    }
+}
+BENCHMARK_TEMPLATE(Bench_bankswitch, false);
+BENCHMARK_TEMPLATE(Bench_bankswitch, true);
+
+// Fetch 16K from the expansion memory, started by a 6502 program
+static void Bench_reu(benchmark::State& state)
+{
+    sixfive::Machine<ReuPolicy> m;
+    sixfive::Reu::map(m, 0xdf00);
+    // lda #0; sta $df02; sta $df04-$df07; lda #$40; sta $df03;
+    // sta $df08; lda #$91; sta $df01; rts
+    static const uint8_t code[] = {
+        0xa9, 0x00, 0x8d, 0x02, 0xdf, 0x8d, 0x04, 0xdf, 0x8d, 0x05, 0xdf,
+        0x8d, 0x06, 0xdf, 0x8d, 0x07, 0xdf, 0xa9, 0x40, 0x8d, 0x03, 0xdf,
+        0x8d, 0x08, 0xdf, 0xa9, 0x91, 0x8d, 0x01, 0xdf, 0x60};
+    m.writeRam(0x1000, code, sizeof(code));
+    while (state.KeepRunning()) {
+        m.setPC(0x1000);
+        m.run();
+    }
+}
+BENCHMARK(Bench_reu);
 
 static void Bench_allops(benchmark::State& state)
 {
     sixfive::Machine<> m;
     m.setPC(0x1000);
-    auto instr = m.getInstructions();
     int total;
     while (state.KeepRunning()) {
         total = 0;
         m.setPC(0x1000);
-        for (const auto& i : instr) {
-            total += i.opcodes.size();
-            for (const auto& o : i.opcodes) {
-                o.op(m);
-            }
+        for (const auto& o : m.jumpTable_normal) {
+            if (!o.op) continue;
+            total++;
+            o.op(m);
         }
     }
     printf("Opcodes %d\n", total);